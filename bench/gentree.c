@@ -0,0 +1,179 @@
+/*
+ * Generate a synthetic void-packages tree for benchmarking xbps-dbulk.
+ *
+ * Packages are generated in dependency order, each one depends on earlier
+ * packages only, so the graph is acyclic.  Dependencies are picked with a
+ * skew towards the first packages, which gives the few heavily used
+ * libraries and long tail of leaves of the real tree.
+ *
+ * Every srcpkgs/<name>/template holds what the fake xbps-src prints for
+ * dbulk-dump, srcpkgs/<name>/cost the build time in milliseconds.
+ */
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t rngstate = 0x9e3779b97f4a7c15;
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64* */
+	rngstate ^= rngstate >> 12;
+	rngstate ^= rngstate << 25;
+	rngstate ^= rngstate >> 27;
+	return rngstate * 0x2545f4914f6cdd1d;
+}
+
+/* uniform in [0, 1) */
+static double
+uniform(void)
+{
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-d maxdeps] [-f fanout] [-H hostfrac] [-n pkgs] [-s seed] [-S subfrac] [-z skew] dir\n", argv0);
+	exit(2);
+}
+
+static double
+number(const char *s)
+{
+	char *end;
+	double d;
+
+	errno = 0;
+	d = strtod(s, &end);
+	if (errno != 0 || *end || d < 0) {
+		fprintf(stderr, "invalid number: %s\n", s);
+		exit(2);
+	}
+	return d;
+}
+
+static FILE *
+create(const char *path)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(path, "w"))) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	return fp;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[4096], name[64];
+	size_t npkgs = 15000, maxdeps = 40;
+	double fanout = 4, hostfrac = 0.3, subfrac = 0.4, skew = 3;
+	size_t *deps;
+	bool *hassub;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:f:H:n:s:S:z:")) != -1) {
+		switch (c) {
+		case 'd': maxdeps = number(optarg); break;
+		case 'f': fanout = number(optarg); break;
+		case 'H': hostfrac = number(optarg); break;
+		case 'n': npkgs = number(optarg); break;
+		case 's': rngstate ^= (uint64_t)number(optarg) * 0xbf58476d1ce4e5b9; break;
+		case 'S': subfrac = number(optarg); break;
+		case 'z': skew = number(optarg); break;
+		default: usage(*argv);
+		}
+	}
+	if (optind + 1 != argc || npkgs == 0)
+		usage(*argv);
+
+	snprintf(path, sizeof path, "%s/srcpkgs", argv[optind]);
+	if (mkdir(argv[optind], 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "mkdir: %s: %s\n", argv[optind], strerror(errno));
+		exit(1);
+	}
+	if (mkdir(path, 0755) == -1) {
+		fprintf(stderr, "mkdir: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (!(deps = calloc(maxdeps + 1, sizeof *deps)) || !(hassub = calloc(npkgs, sizeof *hassub))) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < npkgs; i++) {
+		size_t ndeps = 0, nhost = 0;
+		FILE *fp;
+
+		hassub[i] = uniform() < subfrac;
+		/* geometric number of dependencies */
+		if (i > 0) {
+			while (ndeps < maxdeps && ndeps < i && uniform() < fanout / (fanout + 1)) {
+				double u = uniform(), p = 1;
+				for (int k = 0; k < (int)skew; k++)
+					p *= u;
+				size_t d = p * i;
+				bool dup = false;
+				for (size_t k = 0; k < ndeps; k++)
+					dup |= deps[k] == d;
+				if (!dup)
+					deps[ndeps++] = d;
+			}
+		}
+		/* the first ones are host dependencies */
+		for (size_t k = 0; k < ndeps; k++) {
+			if (uniform() < hostfrac) {
+				size_t t = deps[nhost];
+				deps[nhost++] = deps[k];
+				deps[k] = t;
+			}
+		}
+
+		snprintf(path, sizeof path, "%s/srcpkgs/pkg%06zu", argv[optind], i);
+		if (mkdir(path, 0755) == -1) {
+			fprintf(stderr, "mkdir: %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+		snprintf(path, sizeof path, "%s/srcpkgs/pkg%06zu/template", argv[optind], i);
+		fp = create(path);
+		fprintf(fp, "pkgname: pkg%06zu\nversion: 1.0\nrevision: 1\n", i);
+		fprintf(fp, "hostmakedepends:\n");
+		for (size_t k = 0; k < nhost; k++)
+			fprintf(fp, " pkg%06zu\n", deps[k]);
+		fprintf(fp, "makedepends:\n");
+		for (size_t k = nhost; k < ndeps; k++)
+			fprintf(fp, " pkg%06zu%s\n", deps[k], hassub[deps[k]] ? "-devel" : "");
+		if (hassub[i])
+			fprintf(fp, "subpackages:\n pkg%06zu-devel\n", i);
+		fclose(fp);
+
+		/* mostly short builds, a few very long ones */
+		double u = uniform();
+		snprintf(path, sizeof path, "%s/srcpkgs/pkg%06zu/cost", argv[optind], i);
+		fp = create(path);
+		fprintf(fp, "%.0f\n", 5000 + 3600000 * u * u * u * u);
+		fclose(fp);
+
+		if (hassub[i]) {
+			snprintf(name, sizeof name, "pkg%06zu", i);
+			snprintf(path, sizeof path, "%s/srcpkgs/pkg%06zu-devel", argv[optind], i);
+			if (symlink(name, path) == -1) {
+				fprintf(stderr, "symlink: %s: %s\n", path, strerror(errno));
+				exit(1);
+			}
+		}
+	}
+	free(deps);
+	free(hassub);
+	return 0;
+}
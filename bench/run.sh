@@ -0,0 +1,44 @@
+#!/bin/sh
+# usage: run.sh [-n pkgs] [-k] [gentree options...] [-- xbps-dbulk options...]
+#
+# Generates a synthetic tree, runs a full simulated bulk build and then a
+# no-op run, and reports planning profile, peak memory and makespan.
+# -k keeps the work directory.
+set -e
+bench=$(cd "$(dirname "$0")" && pwd)
+dbulk=${XBPS_DBULK:-$bench/../xbps-dbulk}
+keep=
+genargs=
+while [ $# -gt 0 ]; do
+	case $1 in
+	-k) keep=1; shift;;
+	--) shift; break;;
+	*) genargs="$genargs $1"; shift;;
+	esac
+done
+[ $# -gt 0 ] || set -- -b x86_64 -b aarch64@x86_64 -j 8 -B 64
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/dbulk-bench.XXXXXX")
+[ -n "$keep" ] || trap 'rm -rf "$work"' EXIT
+# shellcheck disable=SC2086
+"$bench/gentree" $genargs "$work/void-packages"
+ln -s "$bench/xbps-src" "$work/void-packages/xbps-src"
+mkdir "$work/state"
+cd "$work/state"
+
+now() { date +%s.%N; }
+echo "bench: tree $(ls "$work/void-packages/srcpkgs" | wc -l) entries in $work"
+
+start=$(now)
+"$dbulk" -D "$work/void-packages" -p "$@" 2>"$work/full.log" || true
+end=$(now)
+grep '^profile:' "$work/full.log" | sed 's/^/bench: full /'
+echo "bench: full makespan $(echo "$start $end" | awk '{ printf "%.3fs", $2 - $1 }')" \
+    "simulated $(echo "$start $end ${BENCH_SCALE:-0.001}" | awk '{ printf "%.1fh", ($2 - $1) / $3 / 3600 }')"
+grep -c 'build package' "$work/full.log" | sed 's/^/bench: full builds /'
+
+start=$(now)
+"$dbulk" -D "$work/void-packages" -p "$@" 2>"$work/noop.log" || true
+end=$(now)
+grep '^profile:' "$work/noop.log" | sed 's/^/bench: noop /'
+echo "bench: noop wall $(echo "$start $end" | awk '{ printf "%.3fs", $2 - $1 }')"
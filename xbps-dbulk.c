@@ -15,40 +15,152 @@
  * THIS SOFTWARE.
 */
 #define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <poll.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "uthash.h"
 
 #ifdef __GLIBC__
 size_t strlcpy(char *dst, const char *src, size_t dsize);
 #endif
 
+/*
+ * The dependency database of a builder, deps/<builder>.db, holds the
+ * parsed .dep files of all packages in one mmap-able file:
+ *
+ *	struct dbheader
+ *	struct dbentry[nentries], sorted by name
+ *	uint32_t refs[nrefs], hostdeps, targetdeps and subpkgs of each entry
+ *	char strings[strsize], NUL terminated and interned
+ *
+ * Strings are referenced by their offset into the string table.
+ */
+#define DBMAGIC "DBULKDB1"
+
+struct dbheader {
+	char magic[8];
+	uint32_t nentries;
+	uint32_t nrefs;
+	uint32_t strsize;
+	uint32_t pad;
+};
+
+struct dbentry {
+	uint32_t name;
+	uint32_t version;
+	uint32_t revision;
+	uint32_t refs;
+	uint32_t nhostdeps;
+	uint32_t ntargetdeps;
+	uint32_t nsubpkgs;
+	uint32_t pad;
+	/* mtime of the .dep file and of the template it was generated from */
+	int64_t depmtime;
+	int64_t srcmtime;
+};
+
+/* a masterdir runs one package build at a time */
+struct masterdir {
+	char *path;
+	/* the running and the previous build, whose deps are installed */
+	struct build *build, *last;
+	struct masterdir *next;
+};
+
 struct builder {
 	char *arch;
 	struct builder *host;
-	char *masterdir;
+	/* pool of masterdirs leased to package builds */
+	struct masterdir **masterdirs;
+	size_t nmasterdirs;
+	char *name;
+
+	/* state directories, deps/<name> and logs/<name> */
+	char *depdir, *logdir;
+	int depfd, logfd;
+
+	const struct dbheader *db;
+	size_t dbsize;
+	const struct dbentry *dbentries;
+	const uint32_t *dbrefs;
+	const char *dbstrings;
+	/* dependencies were read from .dep files, the database is outdated */
+	bool dbdirty;
+
+	UT_hash_handle hh;
+};
+
+enum {
+	HIST_DEPS,
+	HIST_BUILD,
+};
+
+struct hist {
+	/* wall clock time in milliseconds, 0 if unknown */
+	uint64_t duration;
+	/* peak resident set size in kilobytes */
+	long maxrss;
+	int status;
+	/* cpu time in milliseconds and kilobytes read and written */
+	uint64_t cputime;
+	uint64_t io;
+	/* cores the job was given, 0 if unknown */
+	size_t cores;
+};
+
+struct histent {
+	char *key;
+	/* most recent successful and most recent record of each job kind */
+	struct hist ok[2];
+	struct hist last[2];
 	UT_hash_handle hh;
 };
 
+struct use {
+	struct build *build;
+	/* builder whose build of the package releases this edge */
+	struct builder *builder;
+};
+
 struct pkgname {
 	char *name;
 	struct pkgname *srcpkg;
-	size_t nuse;
-	struct build **use;
-	size_t nbuilds;
+	size_t nuse, usecap;
+	struct use *use;
+	size_t nbuilds, buildscap;
 	struct build **builds;
 	time_t mtime;
 	bool dirty;
-	UT_hash_handle hh;
+	/* changed according to git, see gitload */
+	bool changed;
+	/* already a root of the git run, see gitusers */
+	bool gitroot;
 };
 
 struct build {
@@ -57,11 +169,11 @@ struct build {
 	char *revision;
 	struct builder *builder;
 
-	size_t nhostdeps;
+	size_t nhostdeps, hostdepscap;
 	struct pkgname **hostdeps;
-	size_t ntargetdeps;
+	size_t ntargetdeps, targetdepscap;
 	struct pkgname **targetdeps;
-	size_t nsubpkgs;
+	size_t nsubpkgs, subpkgscap;
 	struct pkgname **subpkgs;
 
 	time_t depmtime;
@@ -70,6 +182,22 @@ struct build {
 	time_t logerrmtime;
 
 	size_t nblock;
+	/* cost of the longest chain of dependents, including this build */
+	uint64_t prio;
+	struct histent *hist;
+	const struct dbentry *dbent;
+	/* binary package lookup in the caches, see cachecheck */
+	enum {
+		CACHE_UNKNOWN,
+		CACHE_MISS,
+		CACHE_LOCAL,
+		CACHE_REMOTE,
+		/* remote caches not looked up yet, the fetch job does */
+		CACHE_PROBE,
+	} cache;
+	const char *cacheurl, *cachefile;
+	/* hostdeps deferred while resolving, see resolve */
+	size_t ndefer;
 
 	enum {
 		FLAG_WORK  = 1 << 0,
@@ -77,10 +205,13 @@ struct build {
 		FLAG_DEPS  = 1 << 2,
 		FLAG_DIRTY = 1 << 3,
 		FLAG_SKIP  = 1 << 4,
+		FLAG_PRIO  = 1 << 5,
+		FLAG_VISIT = 1 << 6,
+		FLAG_SOLO  = 1 << 7,
+		FLAG_FETCH = 1 << 8,
 	} flags;
 
 	struct build *allnext;
-	struct build *worknext;
 };
 
 enum {
@@ -95,14 +226,42 @@ struct pool {
 };
 
 static const char *distdir;
+static int srcpkgsfd = -1;
 
-static struct pkgname *pkgnames;
+/*
+ * Open addressing table of all pkgnames.  The slots keep the full hash so
+ * probes only compare names on a likely match, ids lists them densely in
+ * creation order.
+ */
+static struct {
+	struct pkgnameslot {
+		uint64_t hash;
+		struct pkgname *pkgname;
+	} *slots;
+	size_t cap;
+	struct pkgname **ids;
+	size_t len, idscap;
+} pkgnames;
 static struct builder *builders;
 static struct build *builds;
-static struct build *work;
+
+/* ready builds, a max-heap on prio once the graph is planned */
+static struct build **work;
+static size_t nwork, workcap;
+static bool workheap;
+
+static struct histent *history;
+static FILE *histfp;
+/* sum and count of known durations, used to guess unknown ones */
+static uint64_t histsum[2];
+static size_t histcnt[2];
 
 static size_t numtotal;
 static bool explain;
+/* plan a build from scratch for -t simulate, logs are ignored */
+static bool simulating;
+/* estimated milliseconds of work left in queued and blocked jobs */
+static uint64_t remaining;
 
 static void *
 xzmalloc(size_t sz)
@@ -126,6 +285,182 @@ xstrdup(const char *s)
 	return p;
 }
 
+/*
+ * Planning profile, see -p.  The counters are updated from the prefetch
+ * and resolve threads, so they are atomic.
+ */
+static bool profiling;
+
+enum {
+	PROF_STAT,
+	PROF_READLINK,
+	PROF_GETDENTS,
+	PROF_OPEN,
+	PROF_MMAP,
+	PROF_SPAWN,
+	PROF_BYTES,
+	NPROFCOUNT,
+};
+static const char *const profcountnames[] = {"stat", "readlink", "getdents", "open", "mmap", "spawn", "bytes"};
+static _Atomic uint64_t profcounts[NPROFCOUNT];
+
+enum {
+	PROF_PKGNAMESTAT,
+	PROF_DEPSTAT,
+	PROF_LOGSTAT,
+	PROF_LOADDEPS,
+	PROF_READDEPS,
+	NPROFFUNC,
+};
+static const char *const proffuncnames[] = {"pkgnamestat", "depstat", "logstat", "loaddeps", "readdeps"};
+static _Atomic uint64_t proffuncns[NPROFFUNC], proffunccalls[NPROFFUNC];
+
+static uint64_t
+profnow(void)
+{
+	struct timespec ts;
+
+	if (!profiling)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+profcount(int counter, uint64_t n)
+{
+	if (profiling)
+		atomic_fetch_add_explicit(&profcounts[counter], n, memory_order_relaxed);
+}
+
+static void
+proffunc(int func, uint64_t start)
+{
+	if (!profiling)
+		return;
+	atomic_fetch_add_explicit(&proffuncns[func], profnow() - start, memory_order_relaxed);
+	atomic_fetch_add_explicit(&proffunccalls[func], 1, memory_order_relaxed);
+}
+
+/* wall time of the planning phases in main */
+struct profphase {
+	const char *name;
+	uint64_t ns;
+};
+static struct profphase profphases[8];
+static size_t nprofphases;
+
+/* ends the phase started at *start and starts the next one */
+static void
+profphase(const char *name, uint64_t *start)
+{
+	uint64_t now = profnow();
+
+	if (!profiling)
+		return;
+	if (nprofphases < sizeof profphases / sizeof *profphases)
+		profphases[nprofphases++] = (struct profphase){ name, now - *start };
+	*start = now;
+}
+
+/*
+ * Graph nodes and their strings are never freed, so they are bump allocated
+ * from large chunks to keep the walk over them dense.
+ */
+enum { ARENACHUNK = 1 << 20 };
+static struct {
+	char *cur, *end;
+	size_t size;
+} arena;
+
+/*
+ * Serializes changes to the shared parts of the graph while the builders are
+ * resolved on separate threads: the arena, the intern table, the pkgnames
+ * table, the builds and use arrays of each pkgname and the work queue.  It
+ * is recursive so the helpers can take it on their own.
+ */
+static pthread_mutex_t graphlock;
+
+/* callers hold graphlock */
+static void *
+arenaalloc(size_t sz)
+{
+	const size_t align = _Alignof(max_align_t);
+	char *p;
+
+	sz = (sz + align - 1) & ~(align - 1);
+	if (sz > ARENACHUNK / 4) {
+		arena.size += sz;
+		return xzmalloc(sz);
+	}
+	if ((size_t)(arena.end - arena.cur) < sz) {
+		arena.cur = xzmalloc(ARENACHUNK);
+		arena.end = arena.cur + ARENACHUNK;
+		arena.size += ARENACHUNK;
+	}
+	p = arena.cur;
+	arena.cur += sz;
+	return p;
+}
+
+/* open addressing set of all strings copied into the arena */
+static struct {
+	char **slots;
+	size_t cap, len;
+} interned;
+
+static uint64_t
+strhash(const char *s, size_t len)
+{
+	/* FNV-1a */
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+	return h;
+}
+
+static char *
+internn(const char *s, size_t len)
+{
+	size_t i;
+	char *p;
+
+	pthread_mutex_lock(&graphlock);
+	if (interned.len * 2 >= interned.cap) {
+		size_t cap = interned.cap ? interned.cap * 2 : 16384;
+		char **slots = xzmalloc(cap * sizeof *slots);
+		for (i = 0; i < interned.cap; i++) {
+			if (!(p = interned.slots[i]))
+				continue;
+			size_t j = strhash(p, strlen(p)) & (cap - 1);
+			while (slots[j])
+				j = (j + 1) & (cap - 1);
+			slots[j] = p;
+		}
+		free(interned.slots);
+		interned.slots = slots;
+		interned.cap = cap;
+	}
+	for (i = strhash(s, len) & (interned.cap - 1); (p = interned.slots[i]); i = (i + 1) & (interned.cap - 1)) {
+		if (strncmp(p, s, len) == 0 && p[len] == '\0')
+			goto out;
+	}
+	p = arenaalloc(len + 1);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	interned.slots[i] = p;
+	interned.len++;
+out:
+	pthread_mutex_unlock(&graphlock);
+	return p;
+}
+
+static char *
+intern(const char *s)
+{
+	return internn(s, strlen(s));
+}
+
 static void
 xsnprintf(char *buf, size_t buflen, const char *fmt, ...)
 {
@@ -142,729 +477,4003 @@ xsnprintf(char *buf, size_t buflen, const char *fmt, ...)
 	}
 }
 
-static struct builder *
-mkbuilder(const char *arch)
+static void
+xunlinkat(int dirfd, const char *dir, const char *name)
 {
-	struct builder *b;
-	HASH_FIND_STR(builders, arch, b);
-	if (!b) {
-		b = xzmalloc(sizeof *b);
-		b->arch = xstrdup(arch);
-		HASH_ADD_STR(builders, arch, b);
+	if (unlinkat(dirfd, name, 0) == -1 && errno != ENOENT) {
+		fprintf(stderr, "unlink: %s/%s: %s\n", dir, name, strerror(errno));
+		exit(1);
 	}
-	return b;
 }
 
-static struct pkgname *
-mkpkgname(const char *name)
+static void
+xrenameat(int dirfd, const char *dir, const char *from, const char *to)
 {
-	struct pkgname *n;
-	HASH_FIND_STR(pkgnames, name, n);
-	if (!n) {
-		n = xzmalloc(sizeof *n);
-		n->name = xstrdup(name);
-		n->mtime = MTIME_UNKNOWN;
-		n->dirty = false;
-		HASH_ADD_STR(pkgnames, name, n);
+	if (renameat(dirfd, from, dirfd, to) == -1) {
+		fprintf(stderr, "rename: %s/%s: %s\n", dir, from, strerror(errno));
+		exit(1);
 	}
-	return n;
 }
 
+static int
+xopenat(int dirfd, const char *dir, const char *name, int flags)
+{
+	int fd;
+
+	if ((fd = openat(dirfd, name, flags|O_CLOEXEC, 0644)) == -1) {
+		fprintf(stderr, "open: %s/%s: %s\n", dir, name, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+
+static struct masterdir *masterdirs;
+
+/*
+ * A remote build host, builds are run there through ssh with the same distdir
+ * path and the hosts default masterdir.  Logs and exit status come back
+ * through ssh's output and exit status.  Nothing is copied back, the distdir
+ * including hostdir/binpkgs has to be shared with the host, see remotecheck.
+ */
+struct executor {
+	char *host;
+	size_t slots, used;
+	size_t cores;
+	struct executor *next;
+};
+static struct executor *executors;
+/* local plus remote job slots */
+static size_t numslots;
+static size_t numlocal;
+
+/* add a remote executor from a host[:slots[:cores]] specification */
 static void
-pkgnamestat(struct pkgname *pkgname)
+parseexecutor(const char *spec)
 {
-	char buf[PATH_MAX];
-	struct stat st;
+	char host[256];
+	const char *p = strchr(spec, ':');
+	size_t len = p ? (size_t)(p-spec) : strlen(spec);
+	struct executor *ex, **pp;
+	char *end;
 
-	pkgname->mtime = MTIME_MISSING;
-	xsnprintf(buf, sizeof buf, "%s/srcpkgs/%s", distdir, pkgname->name);
-	if (lstat(buf, &st) == -1) {
-		if (errno == ENOENT) {
-			const char *p;
-			if ((p = strrchr(pkgname->name, '-'))) {
-				/* XXX: -32bit should be handled differently */
-				if (strcmp(p, "-dbg") == 0 || strcmp(p, "-32bit") == 0) {
-					strlcpy(buf, pkgname->name, p-pkgname->name+1);
-					pkgname->srcpkg = mkpkgname(buf);
-					if (pkgname->srcpkg->mtime == MTIME_UNKNOWN)
-						pkgnamestat(pkgname->srcpkg);
-					/* use the source packages mtime */
-					pkgname->mtime = pkgname->srcpkg->mtime;
-					return;
-				}
-			}
-		}
-		fprintf(stderr, "lstat: %s: %s\n", buf, strerror(errno));
+	if (len == 0 || len >= sizeof host) {
+		fprintf(stderr, "remote: %s: expected host[:slots[:cores]]\n", spec);
 		exit(1);
 	}
-	if (st.st_mode & S_IFLNK) {
-		/* if this is a subpackage, use the symlinks mtime */
-		pkgname->mtime = st.st_mtime;
-		if (!pkgname->srcpkg) {
-			ssize_t len;
-			if ((len = readlink(buf, buf, sizeof buf)) == -1) {
-				perror("readlink");
-				exit(1);
-			}
-			if ((size_t)len >= sizeof buf) {
-				errno = ENOBUFS;
-				perror("readlink");
+	memcpy(host, spec, len);
+	host[len] = '\0';
+	ex = xzmalloc(sizeof *ex);
+	ex->host = intern(host);
+	ex->slots = 1;
+	if (p) {
+		errno = 0;
+		ex->slots = strtoul(p+1, &end, 10);
+		if (errno || ex->slots == 0 || (*end && *end != ':')) {
+			fprintf(stderr, "remote: %s: invalid slots\n", spec);
+			exit(1);
+		}
+		if (*end == ':') {
+			ex->cores = strtoul(end+1, &end, 10);
+			if (errno || *end) {
+				fprintf(stderr, "remote: %s: invalid cores\n", spec);
 				exit(1);
 			}
-			buf[len] = '\0';
-			if (len > 0 && buf[len-1] == '/') {
-				fprintf(stderr, "warn: symlink `%s/srcpkgs/%s` contains trailing slash.\n", distdir, pkgname->name);
-				buf[len-1] = '\0';
-			}
-			pkgname->srcpkg = mkpkgname(buf);
-			if (pkgname->srcpkg->mtime == MTIME_UNKNOWN)
-				pkgnamestat(pkgname->srcpkg);
 		}
-		return;
 	}
-	if (st.st_mode & S_IFDIR) {
-		/* for source packages, use the templates mtime */
-		xsnprintf(buf, sizeof buf, "%s/srcpkgs/%s/template", distdir, pkgname->name);
-		if (lstat(buf, &st) == -1) {
-			fprintf(stderr, "stat: %s: %s\n", buf, strerror(errno));
-			exit(1);
-		}
-		pkgname->mtime = st.st_mtime;
+	if (ex->cores == 0)
+		ex->cores = ex->slots;
+	/* keep the command line order, the first remote is preferred */
+	for (pp = &executors; *pp; pp = &(*pp)->next)
+		;
+	*pp = ex;
+}
+
+static struct executor *
+executorfree(void)
+{
+	for (struct executor *ex = executors; ex; ex = ex->next) {
+		if (ex->used < ex->slots)
+			return ex;
 	}
+	return NULL;
 }
 
-static void
-depstat(struct build *build)
+static struct masterdir *
+mkmasterdir(const char *path)
 {
-	char buf[PATH_MAX];
-	struct stat st;
+	struct masterdir *md;
 
-	build->depmtime = MTIME_MISSING;
-	build->deperrmtime = MTIME_MISSING;
+	path = intern(path);
+	for (md = masterdirs; md; md = md->next) {
+		if (md->path == path)
+			return md;
+	}
+	md = xzmalloc(sizeof *md);
+	md->path = (char *)path;
+	md->next = masterdirs;
+	masterdirs = md;
+	return md;
+}
+
+static struct builder *
+mkbuilder(const char *arch, struct builder *host)
+{
+	char name[256];
+	struct builder *b;
 
-	if (build->builder->host)
-		xsnprintf(buf, sizeof buf, "deps/%s@%s/%s.dep", build->builder->arch, build->builder->host->arch, build->pkgname->name);
+	if (host)
+		xsnprintf(name, sizeof name, "%s@%s", arch, host->arch);
 	else
-		xsnprintf(buf, sizeof buf, "deps/%s/%s.dep", build->builder->arch, build->pkgname->name);
-	if (stat(buf, &st) == -1) {
-		if (errno != ENOENT) {
-			perror("stat");
+		xsnprintf(name, sizeof name, "%s", arch);
+	HASH_FIND_STR(builders, name, b);
+	if (!b) {
+		pthread_mutex_lock(&graphlock);
+		b = arenaalloc(sizeof *b);
+		pthread_mutex_unlock(&graphlock);
+		b->arch = intern(arch);
+		b->host = host;
+		b->name = intern(name);
+		HASH_ADD_KEYPTR(hh, builders, b->name, strlen(b->name), b);
+	}
+	return b;
+}
+
+/*
+ * Add a builder from a arch[@host][:masterdir[,masterdir]...] specification,
+ * repeating a builder adds to its masterdir pool.  The host has to be
+ * configured as a native builder.
+ */
+static struct builder *
+parsebuilder(const char *spec)
+{
+	char arch[128], hostarch[128] = "";
+	const char *p, *md = NULL;
+	struct builder *host = NULL, *builder;
+	size_t len;
+
+	if ((md = strchr(spec, ':')))
+		len = md++ - spec;
+	else
+		len = strlen(spec);
+	if ((p = memchr(spec, '@', len))) {
+		if ((size_t)(len - (p-spec) - 1) >= sizeof hostarch) {
+			fprintf(stderr, "builder: %s: host arch too long\n", spec);
 			exit(1);
 		}
-	} else {
-		build->depmtime = st.st_mtime;
+		memcpy(hostarch, p+1, len - (p-spec) - 1);
+		hostarch[len - (p-spec) - 1] = '\0';
+		len = p-spec;
 	}
-	if (build->builder->host)
-		xsnprintf(buf, sizeof buf, "deps/%s@%s/%s.err", build->builder->arch, build->builder->host->arch, build->pkgname->name);
-	else
-		xsnprintf(buf, sizeof buf, "deps/%s/%s.err", build->builder->arch, build->pkgname->name);
-	if (stat(buf, &st) == -1) {
-		if (errno != ENOENT) {
-			perror("stat");
+	if (len == 0 || len >= sizeof arch || (p && !*hostarch) || (md && !*md)) {
+		fprintf(stderr, "builder: %s: expected arch[@host][:masterdir[,masterdir]...]\n", spec);
+		exit(1);
+	}
+	memcpy(arch, spec, len);
+	arch[len] = '\0';
+	if (*hostarch) {
+		HASH_FIND_STR(builders, hostarch, host);
+		if (!host) {
+			fprintf(stderr, "builder: %s: host builder %s is not configured\n", spec, hostarch);
 			exit(1);
 		}
-	} else {
-		build->deperrmtime = st.st_mtime;
 	}
+	builder = mkbuilder(arch, host);
+	while (md) {
+		char path[PATH_MAX];
+		const char *end = strchr(md, ',');
+		len = end ? (size_t)(end-md) : strlen(md);
+		if (len == 0 || len >= sizeof path) {
+			fprintf(stderr, "builder: %s: invalid masterdir\n", spec);
+			exit(1);
+		}
+		memcpy(path, md, len);
+		path[len] = '\0';
+		builder->masterdirs = reallocarray(builder->masterdirs, builder->nmasterdirs+1, sizeof *builder->masterdirs);
+		if (!builder->masterdirs) {
+			perror("reallocarray");
+			exit(1);
+		}
+		builder->masterdirs[builder->nmasterdirs++] = mkmasterdir(path);
+		md = end ? end+1 : NULL;
+	}
+	return builder;
 }
 
-static void
-logstat(struct build *build)
+/* whether a job for build has to wait for a masterdir */
+static bool
+masterdirbusy(struct build *build)
 {
-	char buf[PATH_MAX];
-	struct stat st;
+	struct builder *builder = build->builder;
 
-	build->logmtime = MTIME_MISSING;
-	build->logerrmtime = MTIME_MISSING;
+	if ((build->flags & (FLAG_DEPS|FLAG_FETCH)) != FLAG_DEPS || builder->nmasterdirs == 0)
+		return false;
+	for (size_t i = 0; i < builder->nmasterdirs; i++) {
+		if (!builder->masterdirs[i]->build)
+			return false;
+	}
+	return true;
+}
 
-	if (!build->version || !build->revision)
-		return;
+/* dependencies of build already installed in md by its previous build */
+static size_t
+masterdirwarmth(const struct masterdir *md, const struct build *build)
+{
+	const struct build *last = md->last;
+	size_t n = 0;
 
-	if (build->builder->host)
-		xsnprintf(buf, sizeof buf, "logs/%s@%s/%s-%s_%s.log", build->builder->arch, build->builder->host->arch, build->pkgname->name, build->version, build->revision);
-	else
-		xsnprintf(buf, sizeof buf, "logs/%s/%s-%s_%s.log", build->builder->arch, build->pkgname->name, build->version, build->revision);
-	if (stat(buf, &st) == 0) {
-		build->logmtime = st.st_mtime;
-	} else if (errno != ENOENT) {
-		fprintf(stderr, "stat: %s: %s\n", buf, strerror(errno));
-		exit(1);
+	if (!last || last->builder->arch != build->builder->arch)
+		return 0;
+	if (last->pkgname == build->pkgname)
+		return SIZE_MAX;
+	for (size_t i = 0; i < build->nhostdeps; i++) {
+		for (size_t k = 0; k < last->nhostdeps; k++)
+			n += build->hostdeps[i] == last->hostdeps[k];
 	}
-
-	if (build->builder->host)
-		xsnprintf(buf, sizeof buf, "logs/%s@%s/%s-%s_%s.err", build->builder->arch, build->builder->host->arch, build->pkgname->name, build->version, build->revision);
-	else
-		xsnprintf(buf, sizeof buf, "logs/%s/%s-%s_%s.err", build->builder->arch, build->pkgname->name, build->version, build->revision);
-	if (stat(buf, &st) == 0) {
-		build->logerrmtime = st.st_mtime;
-	} else if (errno != ENOENT) {
-		fprintf(stderr, "stat: %s: %s\n", buf, strerror(errno));
-		exit(1);
+	for (size_t i = 0; i < build->ntargetdeps; i++) {
+		for (size_t k = 0; k < last->ntargetdeps; k++)
+			n += build->targetdeps[i] == last->targetdeps[k];
 	}
+	return n;
 }
 
-static void
-pkgnamebuild(struct pkgname *pkgname, struct build *build)
+/* lease the free masterdir of the pool that shares most build deps */
+static struct masterdir *
+masterdirlease(struct build *build)
 {
-	pkgname->builds = reallocarray(pkgname->builds, pkgname->nbuilds+1, sizeof *pkgname->builds);
-	if (!pkgname->builds) {
-		perror("reallocarray");
-		exit(1);
+	struct builder *builder = build->builder;
+	struct masterdir *best = NULL;
+	size_t bestwarmth = 0;
+
+	for (size_t i = 0; i < builder->nmasterdirs; i++) {
+		struct masterdir *md = builder->masterdirs[i];
+		size_t warmth;
+		if (md->build)
+			continue;
+		warmth = masterdirwarmth(md, build);
+		if (!best || warmth > bestwarmth) {
+			best = md;
+			bestwarmth = warmth;
+		}
 	}
-	pkgname->builds[pkgname->nbuilds++] = build;
+	if (best)
+		best->build = build;
+	return best;
 }
 
 static void
-pkgnameuse(struct pkgname *pkgname, struct build *build)
+masterdirrelease(struct masterdir *md)
 {
-	pkgname->use = reallocarray(pkgname->use, pkgname->nuse+1, sizeof *pkgname->use);
-	if (!pkgname->use) {
-		perror("reallocarray");
-		exit(1);
-	}
-	pkgname->use[pkgname->nuse++] = build;
+	md->last = md->build;
+	md->build = NULL;
 }
 
-static void
-addhostdep(struct build *build, const char *name)
+/*
+ * Fill in the leading xbps-src arguments for builder, returns the number of
+ * arguments.  argv needs room for 5 more arguments.
+ */
+static int
+xbpssrcargs(char **argv, char *path, size_t pathlen, struct builder *builder, const struct masterdir *md, const struct executor *ex)
 {
-	struct pkgname *dep = mkpkgname(name);
-	build->hostdeps = reallocarray(build->hostdeps, build->nhostdeps+1, sizeof *build->hostdeps);
-	if (!build->hostdeps) {
-		perror("reallocarray");
-		exit(1);
+	int argc = 0;
+
+	if (ex) {
+		/* masterdirs of the pool are local */
+		md = NULL;
+	} else if (!md && builder->nmasterdirs > 0) {
+		/* dependency generation does not change the masterdir, any will do */
+		md = builder->masterdirs[0];
 	}
-	build->hostdeps[build->nhostdeps++] = dep;
-	pkgnameuse(dep, build);
+	xsnprintf(path, pathlen, "%s/xbps-src", distdir);
+	argv[argc++] = path;
+	if (md) {
+		argv[argc++] = "-m";
+		argv[argc++] = md->path;
+	}
+	if (builder->host) {
+		argv[argc++] = "-a";
+		argv[argc++] = builder->arch;
+	}
+	return argc;
 }
 
+/*
+ * Replace argv by an ssh command running it on the remote executor.  ssh
+ * joins its arguments for the remote shell, so each one is quoted into cmd.
+ * The pty of -tt makes the remote job exit with the ssh client, when it gets
+ * interrupted, timed out or killed.
+ */
 static void
-addtargetdep(struct build *build, const char *name)
+remoteargv(const struct executor *ex, char *argv[], char *cmd, size_t len)
 {
-	struct pkgname *dep = mkpkgname(name);
-	build->targetdeps = reallocarray(build->targetdeps, build->ntargetdeps+1, sizeof *build->targetdeps);
-	if (!build->targetdeps) {
-		perror("reallocarray");
-		exit(1);
+	const char *prefix = "stty -onlcr 2>/dev/null; exec";
+	size_t n = 0;
+
+	if (!ex)
+		return;
+	if (strlen(prefix) >= len)
+		goto toolong;
+	n = stpcpy(cmd, prefix) - cmd;
+	for (char **arg = argv; *arg; arg++) {
+		if (n + 2 >= len)
+			goto toolong;
+		cmd[n++] = ' ';
+		cmd[n++] = '\'';
+		for (const char *p = *arg; *p; p++) {
+			if (*p == '\'') {
+				if (n + 4 >= len)
+					goto toolong;
+				memcpy(cmd+n, "'\\''", 4);
+				n += 4;
+			} else {
+				if (n + 1 >= len)
+					goto toolong;
+				cmd[n++] = *p;
+			}
+		}
+		if (n + 1 >= len)
+			goto toolong;
+		cmd[n++] = '\'';
 	}
-	build->targetdeps[build->ntargetdeps++] = dep;
-	pkgnameuse(dep, build);
+	cmd[n] = '\0';
+	argv[0] = "ssh";
+	argv[1] = "-tt";
+	argv[2] = "-o";
+	argv[3] = "BatchMode=yes";
+	argv[4] = ex->host;
+	argv[5] = "--";
+	argv[6] = cmd;
+	argv[7] = NULL;
+	return;
+toolong:
+	fprintf(stderr, "remote: %s: command too long\n", ex->host);
+	exit(1);
 }
 
-static void
-addsubpkg(struct build *build, const char *name)
+static const char *
+buildername(struct builder *builder)
 {
-	struct pkgname *sub = mkpkgname(name);
-	build->subpkgs = reallocarray(build->subpkgs, build->nsubpkgs+1, sizeof *build->subpkgs);
-	if (!build->subpkgs) {
-		perror("reallocarray");
-		exit(1);
-	}
-	build->subpkgs[build->nsubpkgs++] = sub;
+	return builder->name;
 }
 
-static int
-readdeps(struct build *build, FILE *fp)
+static struct histent *
+histfind(const char *builder, const char *pkgname)
 {
-	const char *d;
-	char *line = NULL;
-	size_t linelen = 0;
-	ssize_t rd;
-	enum {
-		Sdefault = 0x00,
-		Sarray   = 0x01,
-		Shostdep = 0x20,
-		Smakedep = 0x40,
-		Stargdep = 0x60,
-		Ssubpkgs = 0xC0,
-	} state = Sdefault;
+	char key[PATH_MAX];
+	struct histent *ent;
 
-	while ((rd = getdelim(&line, &linelen, '\n', fp)) != -1) {
-		if (line[rd-1] == '\n')
-			line[rd-1] = '\0';
-		if (state & Sarray) {
-			if (*line == ' ') {
-				switch (state & ~Sarray) {
-				case Shostdep:
-					addhostdep(build, line+1);
-					break;
-				case Smakedep:
-					/* fallthrough */
-				case Stargdep:
-					addtargetdep(build, line+1);
-					break;
-				case Ssubpkgs:
-					addsubpkg(build, line+1);
-					break;
-				}
-				continue;
-			}
-			state = Sdefault;
-		}
-		if ((d = strchr(line, ':'))) {
-			if (d[1] == '\0') {
-				state = Sarray;
-				if (strncmp("hostmakedepends", line, d-line) == 0) {
-					state |= Shostdep;
-				} else if (strncmp("makedepends", line, d-line) == 0) {
-					state |= Smakedep;
-				} else if (strncmp("depends", line, d-line) == 0) {
-					state |= Stargdep;
-				} else if (strncmp("subpackages", line, d-line) == 0) {
-					state |= Ssubpkgs;
-				}
-				continue;
-			}
-		} else {
-			free(line);
-			return -1;
-		}
-		if (strncmp("pkgname", line, d-line) == 0) {
-			/* XXX: check if pkgname matches? */
-		} else if (strncmp("version", line, d-line) == 0) {
-			free(build->version);
-			build->version = xstrdup(d+2);
-		} else if (strncmp("revision", line, d-line) == 0) {
-			free(build->revision);
-			build->revision = xstrdup(d+2);
-		} else {
-			/* fprintf(stderr, "key: %.*s value: %s\n", d-line, line, d+2); */
-		}
+	xsnprintf(key, sizeof key, "%s/%s", builder, pkgname);
+	HASH_FIND_STR(history, key, ent);
+	return ent;
+}
+
+static struct histent *
+mkhistent(const char *builder, const char *pkgname)
+{
+	char key[PATH_MAX];
+	struct histent *ent;
+
+	xsnprintf(key, sizeof key, "%s/%s", builder, pkgname);
+	HASH_FIND_STR(history, key, ent);
+	if (!ent) {
+		ent = xzmalloc(sizeof *ent);
+		ent->key = xstrdup(key);
+		HASH_ADD_STR(history, key, ent);
 	}
-	free(line);
+	return ent;
 }
 
 static void
-queue(struct build *build)
+histwrite(FILE *fp, const char *key, int kind, const struct hist *h)
 {
-	struct build **front = &work;
-	build->worknext = *front;
-	*front = build;
+	const char *slash = strchr(key, '/');
+	fprintf(fp, "%s %.*s %s %d %" PRIu64 " %ld %" PRIu64 " %" PRIu64 " %zu\n", kind == HIST_DEPS ? "deps" : "pkg",
+	    (int)(slash-key), key, slash+1, h->status, h->duration, h->maxrss, h->cputime, h->io, h->cores);
 }
 
+/* rewrite the history with only the records still in use */
 static void
-loaddeps(struct build *build)
+histcompact(const char *path)
 {
-	char path[PATH_MAX];
-	struct stat st;
+	char tmp[PATH_MAX];
+	struct histent *ent, *enttmp;
+	FILE *fp;
 
-	if (build->flags & FLAG_DEPS)
-		return;
+	xsnprintf(tmp, sizeof tmp, "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w"))) {
+		fprintf(stderr, "fopen: %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+	HASH_ITER(hh, history, ent, enttmp) {
+		for (int kind = HIST_DEPS; kind <= HIST_BUILD; kind++) {
+			if (ent->ok[kind].duration)
+				histwrite(fp, ent->key, kind, &ent->ok[kind]);
+			if (ent->last[kind].duration && ent->last[kind].status != 0)
+				histwrite(fp, ent->key, kind, &ent->last[kind]);
+		}
+	}
+	if (fclose(fp) == EOF) {
+		fprintf(stderr, "fclose: %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+	if (rename(tmp, path) == -1) {
+		fprintf(stderr, "rename: %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+}
 
-	if (build->builder->host)
-		xsnprintf(path, sizeof path, "deps/%s@%s/%s.dep", build->builder->arch, build->builder->host->arch, build->pkgname->name);
-	else
-		xsnprintf(path, sizeof path, "deps/%s/%s.dep", build->builder->arch, build->pkgname->name);
-	FILE *fp = fopen(path, "r");
-	if (fp == NULL) {
+static void
+histload(const char *path)
+{
+	char line[PATH_MAX+128];
+	char kind[8], builder[128], pkgname[PATH_MAX];
+	struct hist h;
+	size_t nlines = 0, nents = 0;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r"))) {
+		while (fgets(line, sizeof line, fp)) {
+			struct histent *ent;
+			int k;
+			nlines++;
+			/* cpu time, io and cores were added later */
+			h.cputime = h.io = 0;
+			h.cores = 0;
+			if (sscanf(line, "%7s %127s %4095s %d %" SCNu64 " %ld %" SCNu64 " %" SCNu64 " %zu", kind, builder, pkgname,
+			    &h.status, &h.duration, &h.maxrss, &h.cputime, &h.io, &h.cores) < 6) {
+				fprintf(stderr, "warn: %s:%zu: malformed history record\n", path, nlines);
+				continue;
+			}
+			k = strcmp(kind, "deps") == 0 ? HIST_DEPS : HIST_BUILD;
+			ent = mkhistent(builder, pkgname);
+			ent->last[k] = h;
+			if (h.status == 0)
+				ent->ok[k] = h;
+		}
+		fclose(fp);
+	} else if (errno != ENOENT) {
 		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
 		exit(1);
 	}
-	if (readdeps(build, fp) == -1) {
-		perror("readdeps");
+
+	struct histent *ent, *enttmp;
+	HASH_ITER(hh, history, ent, enttmp) {
+		for (int k = HIST_DEPS; k <= HIST_BUILD; k++) {
+			if (ent->ok[k].duration) {
+				histsum[k] += ent->ok[k].duration;
+				histcnt[k]++;
+				nents++;
+			}
+			if (ent->last[k].duration && ent->last[k].status != 0)
+				nents++;
+		}
+	}
+	if (nlines > 2*nents + 1024)
+		histcompact(path);
+
+	if (!(histfp = fopen(path, "a"))) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
 		exit(1);
 	}
-	fclose(fp);
+}
 
-	build->flags |= FLAG_DEPS;
+static void
+histrecord(struct build *build, int kind, const struct hist *h)
+{
+	if (!build->hist)
+		build->hist = mkhistent(buildername(build->builder), build->pkgname->name);
+	build->hist->last[kind] = *h;
+	if (h->status == 0)
+		build->hist->ok[kind] = *h;
+	if (histfp) {
+		histwrite(histfp, build->hist->key, kind, h);
+		fflush(histfp);
+	}
 }
 
-static size_t maxjobs = 1;
+static struct pkgname *
+mkpkgnamen(const char *name, size_t len)
+{
+	uint64_t hash = strhash(name, len);
+	struct pkgname *n;
+	size_t i;
 
-static size_t maxfail = -1;
-static size_t numfail = 0;
-static size_t numfinished = 0;
+	pthread_mutex_lock(&graphlock);
+	if (pkgnames.len * 2 >= pkgnames.cap) {
+		size_t cap = pkgnames.cap ? pkgnames.cap * 2 : 16384;
+		struct pkgnameslot *slots = xzmalloc(cap * sizeof *slots);
+		for (i = 0; i < pkgnames.cap; i++) {
+			if (!pkgnames.slots[i].pkgname)
+				continue;
+			size_t j = pkgnames.slots[i].hash & (cap - 1);
+			while (slots[j].pkgname)
+				j = (j + 1) & (cap - 1);
+			slots[j] = pkgnames.slots[i];
+		}
+		free(pkgnames.slots);
+		pkgnames.slots = slots;
+		pkgnames.cap = cap;
+	}
+	for (i = hash & (pkgnames.cap - 1); (n = pkgnames.slots[i].pkgname); i = (i + 1) & (pkgnames.cap - 1)) {
+		if (pkgnames.slots[i].hash == hash && strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+			goto out;
+	}
+	n = arenaalloc(sizeof *n);
+	n->name = internn(name, len);
+	n->mtime = MTIME_UNKNOWN;
+	n->dirty = false;
+	n->changed = false;
+	pkgnames.slots[i].hash = hash;
+	pkgnames.slots[i].pkgname = n;
+	if (pkgnames.len == pkgnames.idscap) {
+		pkgnames.idscap = pkgnames.idscap ? pkgnames.idscap * 2 : 16384;
+		if (!(pkgnames.ids = reallocarray(pkgnames.ids, pkgnames.idscap, sizeof *pkgnames.ids))) {
+			perror("reallocarray");
+			exit(1);
+		}
+	}
+	pkgnames.ids[pkgnames.len++] = n;
+out:
+	pthread_mutex_unlock(&graphlock);
+	return n;
+}
 
-static bool dryrun = false;
+static struct pkgname *
+mkpkgname(const char *name)
+{
+	return mkpkgnamen(name, strlen(name));
+}
 
-struct job {
-	size_t next;
+/*
+ * Binary package caches given with -c, local repository directories and
+ * remote urls.  Packages found there do not have to be built, packages in
+ * remote caches are fetched into fetchdir once a dirty build needs them.
+ */
+static const char **cachedirs;
+static int *cachedirfds;
+static size_t ncachedirs;
+static const char **cacheurls;
+static size_t ncacheurls;
+static const char *fetchdir;
+
+static bool
+urlexists(const char *url)
+{
+	extern char **environ;
+	char *argv[] = {"curl", "-fsIL", "--max-time", "30", "-o", "/dev/null", (char *)url, NULL};
 	int status;
-	struct build *build;
 	pid_t pid;
-	bool failed;
-};
 
-static void buildadd(struct pkgname *pkgname, struct builder *builder);
+	profcount(PROF_SPAWN, 1);
+	if ((errno = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ))) {
+		fprintf(stderr, "posix_spawn: curl: %s\n", strerror(errno));
+		return false;
+	}
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
 
-static void
-gendepdone(struct job *j)
+/* look up the binary package of build by pkgname, version, revision and arch */
+static int
+cachecheck(struct build *build)
 {
-	char path1[PATH_MAX], path2[PATH_MAX];
-	struct build *build = j->build;
-	const char *name = build->pkgname->name;
+	char name[PATH_MAX], url[PATH_MAX];
+	const char *archs[] = {build->builder->arch, "noarch"};
+	struct stat st;
 
-	if (WIFEXITED(j->status) && WEXITSTATUS(j->status) != 0) {
-		fprintf(stderr, "job failed: %s\n", name);
-		j->failed = true;
+	if (build->cache != CACHE_UNKNOWN)
+		return build->cache;
+	build->cache = CACHE_MISS;
+	if (!build->version || !build->revision)
+		return build->cache;
+	for (size_t i = 0; i < ncachedirs; i++) {
+		for (size_t k = 0; k < 2; k++) {
+			xsnprintf(name, sizeof name, "%s-%s_%s.%s.xbps", build->pkgname->name, build->version, build->revision, archs[k]);
+			profcount(PROF_STAT, 1);
+			if (fstatat(cachedirfds[i], name, &st, 0) == 0)
+				return build->cache = CACHE_LOCAL;
+		}
 	}
-
-	if (j->failed) {
-		if (build->builder->host)
-			xsnprintf(path1, sizeof path1, "deps/%s@%s/%s.dep.tmp", build->builder->arch, build->builder->host->arch, name);
-		else
-			xsnprintf(path1, sizeof path1, "deps/%s/%s.dep.tmp", build->builder->arch, name);
-		if (unlink(path1) == -1) {
-			if (errno != ENOENT) {
-				fprintf(stderr, "unlink: %s: %s\n", path1, strerror(errno));
-				exit(1);
+	/* the event loop must not wait for curl, the package is looked up
+	 * and fetched by a job instead, see buildstart */
+	if (workheap && ncacheurls > 0)
+		return build->cache = CACHE_PROBE;
+	for (size_t i = 0; i < ncacheurls; i++) {
+		for (size_t k = 0; k < 2; k++) {
+			xsnprintf(name, sizeof name, "%s-%s_%s.%s.xbps", build->pkgname->name, build->version, build->revision, archs[k]);
+			xsnprintf(url, sizeof url, "%s/%s", cacheurls[i], name);
+			if (urlexists(url)) {
+				build->cacheurl = intern(url);
+				build->cachefile = intern(name);
+				return build->cache = CACHE_REMOTE;
 			}
 		}
-		if (build->builder->host) {
-			xsnprintf(path1, sizeof path1, "deps/%s@%s/%s.err.tmp", build->builder->arch, build->builder->host->arch, name);
-			xsnprintf(path2, sizeof path2, "deps/%s@%s/%s.err", build->builder->arch, build->builder->host->arch, name);
-		} else {
-			xsnprintf(path1, sizeof path1, "deps/%s/%s.err.tmp", build->builder->arch, name);
-			xsnprintf(path2, sizeof path2, "deps/%s/%s.err", build->builder->arch, name);
-		}
-		if (rename(path1, path2) == -1) {
-			fprintf(stderr, "rename: %s: %s\n", path1, strerror(errno));
-			exit(1);
+	}
+	return build->cache;
+}
+
+static void
+_pkgnamestat(struct pkgname *pkgname)
+{
+	char buf[PATH_MAX];
+	struct stat st;
+
+	pkgname->mtime = MTIME_MISSING;
+	profcount(PROF_STAT, 1);
+	if (fstatat(srcpkgsfd, pkgname->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		if (errno == ENOENT) {
+			const char *p;
+			if ((p = strrchr(pkgname->name, '-'))) {
+				/* XXX: -32bit should be handled differently */
+				if (strcmp(p, "-dbg") == 0 || strcmp(p, "-32bit") == 0) {
+					strlcpy(buf, pkgname->name, p-pkgname->name+1);
+					pkgname->srcpkg = mkpkgname(buf);
+					if (pkgname->srcpkg->mtime == MTIME_UNKNOWN)
+						_pkgnamestat(pkgname->srcpkg);
+					/* use the source packages mtime */
+					pkgname->mtime = pkgname->srcpkg->mtime;
+					return;
+				}
+			}
 		}
-	} else {
-		if (build->builder->host)
-			xsnprintf(path1, sizeof path1, "deps/%s@%s/%s.err.tmp", build->builder->arch, build->builder->host->arch, name);
-		else
-			xsnprintf(path1, sizeof path1, "deps/%s/%s.err.tmp", build->builder->arch, name);
-		if (unlink(path1) == -1) {
-			if (errno != ENOENT) {
-				fprintf(stderr, "unlink: %s: %s\n", path1, strerror(errno));
+		fprintf(stderr, "lstat: %s/srcpkgs/%s: %s\n", distdir, pkgname->name, strerror(errno));
+		exit(1);
+	}
+	if (S_ISLNK(st.st_mode)) {
+		/* if this is a subpackage, use the symlinks mtime */
+		pkgname->mtime = st.st_mtime;
+		if (!pkgname->srcpkg) {
+			ssize_t len;
+			profcount(PROF_READLINK, 1);
+			if ((len = readlinkat(srcpkgsfd, pkgname->name, buf, sizeof buf)) == -1) {
+				perror("readlink");
 				exit(1);
 			}
+			if ((size_t)len >= sizeof buf) {
+				errno = ENOBUFS;
+				perror("readlink");
+				exit(1);
+			}
+			buf[len] = '\0';
+			if (len > 0 && buf[len-1] == '/') {
+				fprintf(stderr, "warn: symlink `%s/srcpkgs/%s` contains trailing slash.\n", distdir, pkgname->name);
+				buf[len-1] = '\0';
+			}
+			pkgname->srcpkg = mkpkgname(buf);
+			if (pkgname->srcpkg->mtime == MTIME_UNKNOWN)
+				_pkgnamestat(pkgname->srcpkg);
 		}
-
-		if (build->builder->host) {
-			xsnprintf(path1, sizeof path1, "deps/%s@%s/%s.dep.tmp", build->builder->arch, build->builder->host->arch, name);
-			xsnprintf(path2, sizeof path2, "deps/%s@%s/%s.dep", build->builder->arch, build->builder->host->arch, name);
-		} else {
-			xsnprintf(path1, sizeof path1, "deps/%s/%s.dep.tmp", build->builder->arch, name);
-			xsnprintf(path2, sizeof path2, "deps/%s/%s.dep", build->builder->arch, name);
-		}
-		if (rename(path1, path2) == -1) {
-			fprintf(stderr, "rename: %s: %s\n", path1, strerror(errno));
+		return;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		/* for source packages, use the templates mtime */
+		xsnprintf(buf, sizeof buf, "%s/template", pkgname->name);
+		profcount(PROF_STAT, 1);
+		if (fstatat(srcpkgsfd, buf, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			fprintf(stderr, "stat: %s/srcpkgs/%s: %s\n", distdir, buf, strerror(errno));
 			exit(1);
 		}
-
-		build->flags &= ~FLAG_WORK;
-		depstat(build);
-		buildadd(build->pkgname, build->builder);
+		pkgname->mtime = st.st_mtime;
 	}
 }
 
-static int
-gendepstart(struct job *j, struct build *build)
+static void
+pkgnamestat(struct pkgname *pkgname)
 {
-	extern char **environ;
-	char path[PATH_MAX];
-	posix_spawn_file_actions_t actions;
-	char *Nargv[] = {NULL, "", "dbulk-dump", build->pkgname->name, NULL};
-	char *Xargv[] = {NULL, "-a", build->builder->arch, "dbulk-dump", build->pkgname->name, NULL};
-	char **argv;
-	int stdoutfd, stderrfd;
+	uint64_t start = profnow();
 
-	j->failed = false;
-	j->build = build;
-	j->status = 0;
+	_pkgnamestat(pkgname);
+	proffunc(PROF_PKGNAMESTAT, start);
+}
 
-	if (build->builder->host)
-		xsnprintf(path, sizeof path, "deps/%s@%s/%s.dep.tmp", build->builder->arch, build->builder->host->arch, build->pkgname->name);
-	else
-		xsnprintf(path, sizeof path, "deps/%s/%s.dep.tmp", build->builder->arch, build->pkgname->name);
-	stdoutfd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
-	if (stdoutfd == -1) {
-		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
-		exit(1);
+static void
+dbopen(struct builder *builder)
+{
+	char path[PATH_MAX];
+	const struct dbheader *hdr;
+	struct stat st;
+	void *p;
+	int fd;
+
+	xsnprintf(path, sizeof path, "deps/%s.db", buildername(builder));
+	profcount(PROF_OPEN, 1);
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+		return;
 	}
-	if (build->builder->host)
-		xsnprintf(path, sizeof path, "deps/%s@%s/%s.err.tmp", build->builder->arch, build->builder->host->arch, build->pkgname->name);
-	else
-		xsnprintf(path, sizeof path, "deps/%s/%s.err.tmp", build->builder->arch, build->pkgname->name);
-	stderrfd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
-	if (stderrfd == -1) {
-		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "fstat: %s: %s\n", path, strerror(errno));
 		exit(1);
 	}
-
-	if (build->builder->host)
-		argv = Xargv;
-	else
-		argv = Nargv;
-
-	xsnprintf(path, sizeof path, "%s/xbps-src", distdir);
-	argv[0] = path;
-
-	if ((errno = posix_spawn_file_actions_init(&actions))) {
-		perror("posix_spawn_file_actions_init");
-		goto err1;
+	if ((size_t)st.st_size < sizeof *hdr)
+		goto bad;
+	if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s: %s\n", path, strerror(errno));
+		exit(1);
 	}
-	if ((errno = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0))) {
-		perror("posix_spawn_file_actions_addopen");
-		goto err2;
+	close(fd);
+	/* other threads may reuse the descriptor, see bad */
+	fd = -1;
+	profcount(PROF_STAT, 1);
+	profcount(PROF_MMAP, 1);
+	profcount(PROF_BYTES, st.st_size);
+	hdr = p;
+	if (memcmp(hdr->magic, DBMAGIC, sizeof hdr->magic) != 0 ||
+	    sizeof *hdr + (uint64_t)hdr->nentries * sizeof (struct dbentry) + (uint64_t)hdr->nrefs * sizeof (uint32_t) + hdr->strsize != (uint64_t)st.st_size ||
+	    hdr->strsize == 0) {
+		munmap(p, st.st_size);
+		goto bad;
 	}
-	if ((errno = posix_spawn_file_actions_adddup2(&actions, stdoutfd, 1))) {
-		perror("posix_spawn_file_actions_adddup2");
-		goto err2;
+	builder->db = hdr;
+	builder->dbsize = st.st_size;
+	builder->dbentries = (const struct dbentry *)(hdr + 1);
+	builder->dbrefs = (const uint32_t *)(builder->dbentries + hdr->nentries);
+	builder->dbstrings = (const char *)(builder->dbrefs + hdr->nrefs);
+	if (builder->dbstrings[hdr->strsize-1] != '\0') {
+		munmap(p, st.st_size);
+		builder->db = NULL;
+		goto bad;
 	}
-	if ((errno = posix_spawn_file_actions_adddup2(&actions, stderrfd, 2))) {
-		perror("posix_spawn_file_actions_adddup2");
-		goto err2;
+	return;
+bad:
+	fprintf(stderr, "warn: %s: invalid dependency database, ignoring it\n", path);
+	builder->dbdirty = true;
+	if (fd != -1)
+		close(fd);
+}
+
+static const char *
+dbstr(struct builder *builder, uint32_t off)
+{
+	if (off >= builder->db->strsize) {
+		fprintf(stderr, "deps/%s.db: string offset out of range\n", buildername(builder));
+		exit(1);
 	}
-	if ((errno = posix_spawn(&j->pid, argv[0], &actions, NULL, argv, environ))) {
-		fprintf(stderr, "posix_spawn: %s: %s\n", build->pkgname->name, strerror(errno));
-		goto err2;
+	return builder->dbstrings + off;
+}
+
+static const struct dbentry *
+dbfind(struct builder *builder, const char *name)
+{
+	size_t lo = 0, hi;
+
+	if (!builder->db)
+		return NULL;
+	hi = builder->db->nentries;
+	while (lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		int r = strcmp(name, dbstr(builder, builder->dbentries[mid].name));
+		if (r == 0)
+			return &builder->dbentries[mid];
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid+1;
 	}
-	posix_spawn_file_actions_destroy(&actions);
-	close(stdoutfd);
-	close(stderrfd);
+	return NULL;
+}
 
-	return 0;
+struct dbrec {
+	const char *name;
+	const char *version;
+	const char *revision;
+	size_t nhostdeps, ntargetdeps, nsubpkgs;
+	const char **refs;
+	int64_t depmtime;
+	int64_t srcmtime;
+};
 
-err2:
-	posix_spawn_file_actions_destroy(&actions);
-err1:
-	close(stdoutfd);
-	close(stderrfd);
-err0:
-	return -1;
+struct dbstrent {
+	const char *s;
+	uint32_t off;
+	UT_hash_handle hh;
+};
+
+static int
+dbreccmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dbrec *)a)->name, ((const struct dbrec *)b)->name);
 }
 
-static void
-pkgnamedone(struct pkgname *pkgname, bool prune)
+static uint32_t
+dbintern(struct dbstrent **tab, char **strs, size_t *len, size_t *cap, const char *str)
 {
-	pkgname->dirty = false;
-	for (size_t i = 0; i < pkgname->nuse; i++) {
-		struct build *build = pkgname->use[i];
-		/* skip edges not used in this build */
-		if (!(build->flags & FLAG_WORK))
-			continue;
-		if (--build->nblock == 0)
-			queue(build);
+	struct dbstrent *ent;
+	size_t n;
+
+	if (!str)
+		str = "";
+	HASH_FIND_STR(*tab, str, ent);
+	if (ent)
+		return ent->off;
+	n = strlen(str)+1;
+	if (*len + n > *cap) {
+		*cap = *cap ? *cap*2 : 65536;
+		if (*cap < *len + n)
+			*cap = *len + n;
+		if (!(*strs = realloc(*strs, *cap))) {
+			perror("realloc");
+			exit(1);
+		}
 	}
+	memcpy(*strs + *len, str, n);
+	ent = xzmalloc(sizeof *ent);
+	ent->s = str;
+	ent->off = *len;
+	*len += n;
+	HASH_ADD_KEYPTR(hh, *tab, ent->s, n-1, ent);
+	return ent->off;
 }
 
-static void
-builddone(struct job *j)
+static const char **
+dbrefs(size_t n)
 {
-	char path1[PATH_MAX], path2[PATH_MAX];
-	struct build *build = j->build;
-	const char *name = build->pkgname->name;
-	const char *version = build->version;
-	const char *revision = build->revision;
-
-	if (WIFEXITED(j->status) && WEXITSTATUS(j->status) != 0) {
-		fprintf(stderr, "job failed: %s\n", name);
-		j->failed = true;
+	const char **refs = calloc(n ? n : 1, sizeof *refs);
+	if (!refs) {
+		perror("calloc");
+		exit(1);
 	}
+	return refs;
+}
 
-	if (j->failed) {
-		if (build->builder->host) {
-			xsnprintf(path1, sizeof path1, "logs/%s@%s/%s-%s_%s.tmp", build->builder->arch, build->builder->host->arch, name, version, revision);
-			xsnprintf(path2, sizeof path2, "logs/%s@%s/%s-%s_%s.err", build->builder->arch, build->builder->host->arch, name, version, revision);
-		} else {
-			xsnprintf(path1, sizeof path1, "logs/%s/%s-%s_%s.tmp", build->builder->arch, name, version, revision);
-			xsnprintf(path2, sizeof path2, "logs/%s/%s-%s_%s.err", build->builder->arch, name, version, revision);
-		}
-		if (rename(path1, path2) == -1) {
-			fprintf(stderr, "rename: %s: %s\n", path1, strerror(errno));
-			exit(1);
+/* write the dependencies known this run, keep entries of packages not seen */
+static void
+dbwrite(struct builder *builder)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct dbrec *recs = NULL;
+	size_t nrecs = 0, caprecs = 0, nrefs = 0;
+	struct dbstrent *tab = NULL, *ent, *enttmp;
+	char *strs = NULL;
+	size_t strslen = 0, strscap = 0;
+	struct dbheader hdr = {0};
+	FILE *fp;
+
+	if (!builder->dbdirty)
+		return;
+
+	for (struct build *b = builds; b; b = b->allnext) {
+		struct dbrec *r;
+		if (b->builder != builder || !(b->flags & FLAG_DEPS))
+			continue;
+		if (nrecs == caprecs) {
+			caprecs = caprecs ? caprecs*2 : 1024;
+			if (!(recs = reallocarray(recs, caprecs, sizeof *recs))) {
+				perror("reallocarray");
+				exit(1);
+			}
 		}
-	} else {
-		if (build->builder->host) {
-			xsnprintf(path1, sizeof path1, "logs/%s@%s/%s-%s_%s.tmp", build->builder->arch, build->builder->host->arch, name, version, revision);
-			xsnprintf(path2, sizeof path2, "logs/%s@%s/%s-%s_%s.log", build->builder->arch, build->builder->host->arch, name, version, revision);
-		} else {
-			xsnprintf(path1, sizeof path1, "logs/%s/%s-%s_%s.tmp", build->builder->arch, name, version, revision);
-			xsnprintf(path2, sizeof path2, "logs/%s/%s-%s_%s.log", build->builder->arch, name, version, revision);
+		r = &recs[nrecs++];
+		r->name = b->pkgname->name;
+		r->version = b->version;
+		r->revision = b->revision;
+		r->nhostdeps = b->nhostdeps;
+		r->ntargetdeps = b->ntargetdeps;
+		r->nsubpkgs = b->nsubpkgs;
+		r->refs = dbrefs(b->nhostdeps + b->ntargetdeps + b->nsubpkgs);
+		for (size_t i = 0; i < b->nhostdeps; i++)
+			r->refs[i] = b->hostdeps[i]->name;
+		for (size_t i = 0; i < b->ntargetdeps; i++)
+			r->refs[b->nhostdeps+i] = b->targetdeps[i]->name;
+		for (size_t i = 0; i < b->nsubpkgs; i++)
+			r->refs[b->nhostdeps+b->ntargetdeps+i] = b->subpkgs[i]->name;
+		r->depmtime = b->depmtime;
+		r->srcmtime = b->pkgname->mtime;
+	}
+	qsort(recs, nrecs, sizeof *recs, dbreccmp);
+
+	/* carry over the entries of packages that were not loaded */
+	size_t nnew = nrecs;
+	for (uint32_t i = 0; builder->db && i < builder->db->nentries; i++) {
+		const struct dbentry *e = &builder->dbentries[i];
+		struct dbrec key = { .name = dbstr(builder, e->name) }, *r;
+		size_t n = e->nhostdeps + e->ntargetdeps + e->nsubpkgs;
+		if (bsearch(&key, recs, nnew, sizeof *recs, dbreccmp))
+			continue;
+		if ((uint64_t)e->refs + n > builder->db->nrefs)
+			continue;
+		if (nrecs == caprecs) {
+			caprecs = caprecs ? caprecs*2 : 1024;
+			if (!(recs = reallocarray(recs, caprecs, sizeof *recs))) {
+				perror("reallocarray");
+				exit(1);
+			}
 		}
-		if (rename(path1, path2) == -1) {
-			fprintf(stderr, "rename: %s: %s\n", path1, strerror(errno));
+		r = &recs[nrecs++];
+		r->name = key.name;
+		r->version = dbstr(builder, e->version);
+		r->revision = dbstr(builder, e->revision);
+		r->nhostdeps = e->nhostdeps;
+		r->ntargetdeps = e->ntargetdeps;
+		r->nsubpkgs = e->nsubpkgs;
+		r->refs = dbrefs(n);
+		for (size_t k = 0; k < n; k++)
+			r->refs[k] = dbstr(builder, builder->dbrefs[e->refs+k]);
+		r->depmtime = e->depmtime;
+		r->srcmtime = e->srcmtime;
+	}
+	qsort(recs, nrecs, sizeof *recs, dbreccmp);
+
+	xsnprintf(path, sizeof path, "deps/%s.db", buildername(builder));
+	xsnprintf(tmp, sizeof tmp, "deps/%s.db.tmp", buildername(builder));
+	if (!(fp = fopen(tmp, "w"))) {
+		fprintf(stderr, "fopen: %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+
+	uint32_t *refs = calloc(1, sizeof *refs);
+	struct dbentry *entries = calloc(nrecs ? nrecs : 1, sizeof *entries);
+	if (!entries || !refs) {
+		perror("calloc");
+		exit(1);
+	}
+	for (size_t i = 0; i < nrecs; i++) {
+		struct dbrec *r = &recs[i];
+		size_t n = r->nhostdeps + r->ntargetdeps + r->nsubpkgs;
+		entries[i].name = dbintern(&tab, &strs, &strslen, &strscap, r->name);
+		entries[i].version = dbintern(&tab, &strs, &strslen, &strscap, r->version);
+		entries[i].revision = dbintern(&tab, &strs, &strslen, &strscap, r->revision);
+		entries[i].refs = nrefs;
+		entries[i].nhostdeps = r->nhostdeps;
+		entries[i].ntargetdeps = r->ntargetdeps;
+		entries[i].nsubpkgs = r->nsubpkgs;
+		entries[i].depmtime = r->depmtime;
+		entries[i].srcmtime = r->srcmtime;
+		if (!(refs = reallocarray(refs, nrefs + n + 1, sizeof *refs))) {
+			perror("reallocarray");
 			exit(1);
 		}
+		for (size_t k = 0; k < n; k++)
+			refs[nrefs++] = dbintern(&tab, &strs, &strslen, &strscap, r->refs[k]);
+	}
+	/* the string table has at least the empty string */
+	dbintern(&tab, &strs, &strslen, &strscap, "");
 
-		build->flags &= ~FLAG_DIRTY;
-		pkgnamedone(build->pkgname, false);
-		for (size_t i = 0; i < build->nsubpkgs; i++) {
-			pkgnamedone(build->subpkgs[i], false);
-		}
+	memcpy(hdr.magic, DBMAGIC, sizeof hdr.magic);
+	hdr.nentries = nrecs;
+	hdr.nrefs = nrefs;
+	hdr.strsize = strslen;
+	fwrite(&hdr, sizeof hdr, 1, fp);
+	fwrite(entries, sizeof *entries, nrecs, fp);
+	fwrite(refs, sizeof *refs, nrefs, fp);
+	fwrite(strs, 1, strslen, fp);
+	if (ferror(fp) || fclose(fp) == EOF) {
+		fprintf(stderr, "write: %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+	if (rename(tmp, path) == -1) {
+		fprintf(stderr, "rename: %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+
+	HASH_ITER(hh, tab, ent, enttmp) {
+		HASH_DEL(tab, ent);
+		free(ent);
 	}
+	for (size_t i = 0; i < nrecs; i++)
+		free(recs[i].refs);
+	free(recs);
+	free(entries);
+	free(refs);
+	free(strs);
+	builder->dbdirty = false;
 }
 
-static int
-buildstart(struct job *j, struct build *build)
+static void
+_depstat(struct build *build)
 {
-	extern char **environ;
-	char path[PATH_MAX];
-	posix_spawn_file_actions_t actions;
-	char *Nargv[] = {NULL, "-1Et", "-j", "4", "pkg", build->pkgname->name, NULL};
-	char *Xargv[] = {NULL, "-a", build->builder->arch, "-1Et", "-j", "4", "pkg", build->pkgname->name, NULL};
-	char **argv;
-	int fd;
+	char buf[PATH_MAX];
+	struct stat st;
 
-	j->failed = false;
-	j->build = build;
-	j->status = 0;
+	build->depmtime = MTIME_MISSING;
+	build->deperrmtime = MTIME_MISSING;
 
-	if (build->builder->host)
-		xsnprintf(path, sizeof path, "logs/%s@%s/%s-%s_%s.tmp", build->builder->arch, build->builder->host->arch, build->pkgname->name, build->version, build->revision);
-	else
-		xsnprintf(path, sizeof path, "logs/%s/%s-%s_%s.tmp", build->builder->arch, build->pkgname->name, build->version, build->revision);
-	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
-	if (fd == -1) {
-		perror("open");
-		exit(1);
+	/* the database entry is good as long as the template didn't change */
+	const struct dbentry *ent = dbfind(build->builder, build->pkgname->name);
+	if (ent && ent->depmtime >= build->pkgname->mtime) {
+		build->depmtime = ent->depmtime;
+		build->dbent = ent;
+		return;
 	}
+	build->dbent = NULL;
 
-	if (build->builder->host)
-		argv = Xargv;
-	else
-		argv = Nargv;
-	xsnprintf(path, sizeof path, "%s/xbps-src", distdir);
-	argv[0] = path;
+	profcount(PROF_STAT, 2);
 
-	if ((errno = posix_spawn_file_actions_init(&actions))) {
-		perror("posix_spawn_file_actions_init");
-		goto err1;
-	}
-	if ((errno = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0))) {
-		perror("posix_spawn_file_actions_addopen");
-		goto err2;
-	}
-	if ((errno = posix_spawn_file_actions_adddup2(&actions, fd, 1))) {
-		perror("posix_spawn_file_actions_adddup2");
-		goto err2;
-	}
-	if ((errno = posix_spawn_file_actions_adddup2(&actions, fd, 2))) {
-		perror("posix_spawn_file_actions_adddup2");
-		goto err2;
+	xsnprintf(buf, sizeof buf, "%s.dep", build->pkgname->name);
+	if (fstatat(build->builder->depfd, buf, &st, 0) == -1) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "stat: %s/%s: %s\n", build->builder->depdir, buf, strerror(errno));
+			exit(1);
+		}
+	} else {
+		build->depmtime = st.st_mtime;
 	}
-	if ((errno = posix_spawn(&j->pid, argv[0], &actions, NULL, argv, environ))) {
-		fprintf(stderr, "posix_spawn: %s: %s\n", build->pkgname->name, strerror(errno));
-		goto err2;
+	xsnprintf(buf, sizeof buf, "%s.err", build->pkgname->name);
+	if (fstatat(build->builder->depfd, buf, &st, 0) == -1) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "stat: %s/%s: %s\n", build->builder->depdir, buf, strerror(errno));
+			exit(1);
+		}
+	} else {
+		build->deperrmtime = st.st_mtime;
 	}
-	posix_spawn_file_actions_destroy(&actions);
-	close(fd);
+}
 
-	return 0;
+static void
+depstat(struct build *build)
+{
+	uint64_t start = profnow();
 
-err2:
-	posix_spawn_file_actions_destroy(&actions);
-err1:
-	close(fd);
-err0:
-	return -1;
+	_depstat(build);
+	proffunc(PROF_DEPSTAT, start);
 }
 
-static int
-jobstart(struct job *j, struct build *build)
+static void
+_logstat(struct build *build)
 {
-	if (build->flags & FLAG_DEPS) {
-		return buildstart(j, build);
-	} else {
-		return gendepstart(j, build);
+	char buf[PATH_MAX];
+	struct stat st;
+
+	build->logmtime = MTIME_MISSING;
+	build->logerrmtime = MTIME_MISSING;
+
+	if (!build->version || !build->revision)
+		return;
+
+	profcount(PROF_STAT, 2);
+	xsnprintf(buf, sizeof buf, "%s-%s_%s.log", build->pkgname->name, build->version, build->revision);
+	if (fstatat(build->builder->logfd, buf, &st, 0) == 0) {
+		build->logmtime = st.st_mtime;
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "stat: %s/%s: %s\n", build->builder->logdir, buf, strerror(errno));
+		exit(1);
+	}
+
+	xsnprintf(buf, sizeof buf, "%s-%s_%s.err", build->pkgname->name, build->version, build->revision);
+	if (fstatat(build->builder->logfd, buf, &st, 0) == 0) {
+		build->logerrmtime = st.st_mtime;
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "stat: %s/%s: %s\n", build->builder->logdir, buf, strerror(errno));
+		exit(1);
 	}
 }
 
 static void
-jobdone(struct job *j)
+logstat(struct build *build)
 {
-	numfinished++;
-	if (WIFEXITED(j->status)) {
-		; /* exit status is handled by builddone and gendepdone */
-	} else if (WIFSIGNALED(j->status)) {
-		fprintf(stderr, "job terminated due to signal %d: %s\n", WTERMSIG(j->status), j->build->pkgname->name);
-		j->failed = true;
+	uint64_t start = profnow();
+
+	_logstat(build);
+	proffunc(PROF_LOGSTAT, start);
+}
+
+
+/*
+ * Make room for one more element in an edge array.  Arrays with a capacity
+ * of 0 live in packed storage and are copied out on their first growth.
+ */
+static void *
+grow(void *p, size_t n, size_t *cap, size_t sz)
+{
+	size_t newcap;
+	void *q;
+
+	if (n < *cap)
+		return p;
+	newcap = n < 4 ? 4 : n * 2;
+	if (*cap == 0) {
+		if ((q = reallocarray(NULL, newcap, sz)) && n > 0)
+			memcpy(q, p, n * sz);
 	} else {
-		/* cannot happen according to POSIX */
-		fprintf(stderr, "job status unknown: %s\n", j->build->pkgname->name);
-		j->failed = true;
+		q = reallocarray(p, newcap, sz);
 	}
-	if (j->build->flags & FLAG_DEPS) {
-		builddone(j);
-	} else {
-		gendepdone(j);
+	if (!q) {
+		perror("reallocarray");
+		exit(1);
 	}
+	*cap = newcap;
+	return q;
 }
 
-static struct build *
-mkbuild(struct pkgname *pkgname, struct builder *builder)
+static void
+pkgnamebuild(struct pkgname *pkgname, struct build *build)
+{
+	pkgname->builds = grow(pkgname->builds, pkgname->nbuilds, &pkgname->buildscap, sizeof *pkgname->builds);
+	pkgname->builds[pkgname->nbuilds++] = build;
+}
+
+static void
+pkgnameuse(struct pkgname *pkgname, struct build *build, struct builder *builder)
+{
+	pthread_mutex_lock(&graphlock);
+	pkgname->use = grow(pkgname->use, pkgname->nuse, &pkgname->usecap, sizeof *pkgname->use);
+	pkgname->use[pkgname->nuse].build = build;
+	pkgname->use[pkgname->nuse].builder = builder;
+	pkgname->nuse++;
+	pthread_mutex_unlock(&graphlock);
+}
+
+static void
+addhostdep(struct build *build, struct pkgname *dep)
+{
+	build->hostdeps = grow(build->hostdeps, build->nhostdeps, &build->hostdepscap, sizeof *build->hostdeps);
+	build->hostdeps[build->nhostdeps++] = dep;
+	pkgnameuse(dep, build, build->builder->host ? build->builder->host : build->builder);
+}
+
+static void
+addtargetdep(struct build *build, struct pkgname *dep)
+{
+	build->targetdeps = grow(build->targetdeps, build->ntargetdeps, &build->targetdepscap, sizeof *build->targetdeps);
+	build->targetdeps[build->ntargetdeps++] = dep;
+	pkgnameuse(dep, build, build->builder);
+}
+
+static void
+addsubpkg(struct build *build, struct pkgname *sub)
+{
+	build->subpkgs = grow(build->subpkgs, build->nsubpkgs, &build->subpkgscap, sizeof *build->subpkgs);
+	build->subpkgs[build->nsubpkgs++] = sub;
+}
+
+/* move an edge array into packed storage at *dst */
+static void *
+pack(void *p, size_t n, size_t *cap, size_t sz, char **dst)
+{
+	void *q = *dst;
+
+	if (n == 0)
+		return p;
+	memcpy(q, p, n * sz);
+	if (*cap)
+		free(p);
+	*cap = 0;
+	*dst += n * sz;
+	return q;
+}
+
+/*
+ * Once the initial walk has read all dependency files, pack the forward
+ * edges of every build and the reverse edges of every pkgname into two
+ * contiguous blocks, ordered like the build and pkgname lists which are
+ * walked by buildadd and pkgnamedone.
+ */
+static void
+packedges(void)
 {
 	struct build *build;
-	build = xzmalloc(sizeof *build);
-	build->builder = builder;
-	build->pkgname = pkgname;
-	build->allnext = builds;
-	build->depmtime = MTIME_UNKNOWN;
-	build->deperrmtime = MTIME_UNKNOWN;
-	build->logmtime = MTIME_UNKNOWN;
-	build->logerrmtime = MTIME_UNKNOWN;
-	builds = build;
-	pkgnamebuild(pkgname, build);
-	return build;
+	size_t nfwd = 0, nuse = 0;
+	char *p;
+
+	for (build = builds; build; build = build->allnext)
+		nfwd += build->nhostdeps + build->ntargetdeps + build->nsubpkgs;
+	for (size_t i = 0; i < pkgnames.len; i++)
+		nuse += pkgnames.ids[i]->nuse;
+
+	p = xzmalloc((nfwd ? nfwd : 1) * sizeof (struct pkgname *));
+	for (build = builds; build; build = build->allnext) {
+		build->hostdeps = pack(build->hostdeps, build->nhostdeps, &build->hostdepscap, sizeof *build->hostdeps, &p);
+		build->targetdeps = pack(build->targetdeps, build->ntargetdeps, &build->targetdepscap, sizeof *build->targetdeps, &p);
+		build->subpkgs = pack(build->subpkgs, build->nsubpkgs, &build->subpkgscap, sizeof *build->subpkgs, &p);
+	}
+	p = xzmalloc((nuse ? nuse : 1) * sizeof (struct use));
+	for (size_t i = 0; i < pkgnames.len; i++) {
+		struct pkgname *pkgname = pkgnames.ids[i];
+		pkgname->use = pack(pkgname->use, pkgname->nuse, &pkgname->usecap, sizeof *pkgname->use, &p);
+	}
 }
 
+/*
+ * Parse the dbulk-dump output of a single package in place, dependency
+ * names are interned straight from buf.
+ */
 static int
-_buildadd(struct pkgname *pkgname, struct builder *builder)
+_readdeps(struct build *build, const char *buf, size_t len)
 {
-	struct build *build = NULL;
+	const char *p = buf, *end = buf + len;
+	enum {
+		Sdefault,
+		Signore,
+		Shostdep,
+		Stargdep,
+		Ssubpkgs,
+	} state = Sdefault;
 
-	if (pkgname->mtime == MTIME_UNKNOWN) {
-		pkgnamestat(pkgname);
-		if (pkgname->mtime == MTIME_MISSING) {
-			build->flags |= FLAG_SKIP|FLAG_DIRTY;
-			if (explain)
-				fprintf(stderr, "explain: %s: skipping, no template to build package\n", pkgname->name);
-			goto out;
+	while (p < end) {
+		const char *line = p, *eol, *d, *val;
+		if ((eol = memchr(p, '\n', end-p)))
+			p = eol+1;
+		else
+			p = eol = end;
+		if (line == eol)
+			continue;
+		if (*line == ' ' && state != Sdefault) {
+			struct pkgname *pkgname = mkpkgnamen(line+1, eol-line-1);
+			switch (state) {
+			case Shostdep: addhostdep(build, pkgname); break;
+			case Stargdep: addtargetdep(build, pkgname); break;
+			case Ssubpkgs: addsubpkg(build, pkgname); break;
+			default: break;
+			}
+			continue;
 		}
-	}
-	
-	struct pkgname *srcpkg = pkgname->srcpkg ? pkgname->srcpkg : pkgname;
-	for (size_t i = 0; i < srcpkg->nbuilds; i++) {
-		if (srcpkg->builds[i]->builder == builder) {
-			build = srcpkg->builds[i];
+		if (!(d = memchr(line, ':', eol-line))) {
+			errno = EINVAL;
+			return -1;
+		}
+		val = d+1 < eol && d[1] == ' ' ? d+2 : d+1;
+		state = Sdefault;
+#define KEY(k) (d-line == sizeof k - 1 && memcmp(line, k, sizeof k - 1) == 0)
+		switch (d-line) {
+		case 7:
+			if (KEY("version"))
+				build->version = internn(val, eol-val);
+			else if (KEY("depends"))
+				state = Stargdep;
+			/* XXX: check if pkgname matches? */
+			break;
+		case 8:
+			if (KEY("revision"))
+				build->revision = internn(val, eol-val);
+			break;
+		case 11:
+			if (KEY("makedepends"))
+				state = Stargdep;
+			else if (KEY("subpackages"))
+				state = Ssubpkgs;
+			break;
+		case 15:
+			if (KEY("hostmakedepends"))
+				state = Shostdep;
 			break;
 		}
+#undef KEY
+		if (d+1 != eol)
+			state = Sdefault;
+		else if (state == Sdefault)
+			state = Signore;
 	}
-	if (!build)
-		build = mkbuild(srcpkg, builder);
+	return 0;
+}
 
-	if (build->flags & FLAG_CYCLE) {
-		build->flags |= FLAG_SKIP|FLAG_DIRTY;
-		if (explain)
-			fprintf(stderr, "explain: %s: skipping, dependency cycle involving: %s", pkgname->name, pkgname->name);
-		goto err;
-	}
-	if (build->flags & FLAG_WORK)
-		return 0;
+static int
+readdeps(struct build *build, const char *buf, size_t len)
+{
+	uint64_t start = profnow();
+	int rv = _readdeps(build, buf, len);
 
-	build->flags |= FLAG_CYCLE|FLAG_WORK;
-	build->flags &= ~FLAG_DIRTY;
+	proffunc(PROF_READDEPS, start);
+	return rv;
+}
 
-	/* build->pkgname->dirty = false; */
-	/* if (build->pkgname->mtime == MTIME_UNKNOWN) */
-	/* 	pkgnamestat(build->pkgname); */
-	for (size_t i = 0; i < build->nsubpkgs; i++) {
-		struct pkgname *n1 = build->subpkgs[i];
-		/* build->pkgname->dirty = false; */
-		/* if (n1->mtime == MTIME_UNKNOWN) */
-		/* 	pkgnamestat(n1); */
-	}
+/* estimated milliseconds the next job of the build takes */
+static uint64_t
+buildcost(struct build *build)
+{
+	int kind = build->flags & FLAG_DEPS ? HIST_BUILD : HIST_DEPS;
 
-	if (build->depmtime == MTIME_UNKNOWN)
-		depstat(build);
+	if (build->hist && build->hist->ok[kind].duration)
+		return build->hist->ok[kind].duration;
+	if (histcnt[kind])
+		return histsum[kind] / histcnt[kind];
+	return kind == HIST_BUILD ? 60000 : 1000;
+}
 
-	/* dep file missing or outdated */
-	if (build->depmtime < build->pkgname->mtime) {
-		/* depfile error missing or older than template, regenerate it */
-		if (build->deperrmtime < build->pkgname->mtime) {
-			/* XXX: order is irrelevant, but would ordering still make sense
-			 * to prioritize building packages over generating deps in
-			 * case we have an old dep file? */
-			if (explain)
-				fprintf(stderr, "explain %s@%s: dependency file %s\n", build->pkgname->name, build->builder->arch,
+static uint64_t
+buildprio(struct build *build)
+{
+	uint64_t max = 0;
+
+	if (build->flags & FLAG_PRIO)
+		return build->prio;
+	/* dependency cycles are skipped, but don't loop on them */
+	if (build->flags & FLAG_VISIT)
+		return 0;
+	build->flags |= FLAG_VISIT;
+	for (size_t i = 0; i <= build->nsubpkgs; i++) {
+		struct pkgname *pkgname = i == 0 ? build->pkgname : build->subpkgs[i-1];
+		for (size_t j = 0; j < pkgname->nuse; j++) {
+			struct build *dep = pkgname->use[j].build;
+			uint64_t prio;
+			if (pkgname->use[j].builder != build->builder)
+				continue;
+			if ((dep->flags & (FLAG_WORK|FLAG_DIRTY|FLAG_SKIP)) != (FLAG_WORK|FLAG_DIRTY))
+				continue;
+			if ((prio = buildprio(dep)) > max)
+				max = prio;
+		}
+	}
+	build->flags &= ~FLAG_VISIT;
+	build->flags |= FLAG_PRIO;
+	build->prio = buildcost(build) + max;
+	return build->prio;
+}
+
+static bool
+workless(struct build *a, struct build *b)
+{
+	int r;
+	if (a->prio != b->prio)
+		return a->prio < b->prio;
+	if ((r = strcmp(a->pkgname->name, b->pkgname->name)) != 0)
+		return r > 0;
+	return strcmp(a->builder->arch, b->builder->arch) > 0;
+}
+
+static void
+worksiftdown(size_t i)
+{
+	struct build *b = work[i];
+	for (;;) {
+		size_t c = 2*i+1;
+		if (c >= nwork)
+			break;
+		if (c+1 < nwork && workless(work[c], work[c+1]))
+			c++;
+		if (!workless(b, work[c]))
+			break;
+		work[i] = work[c];
+		i = c;
+	}
+	work[i] = b;
+}
+
+static void
+worksiftup(size_t i)
+{
+	struct build *b = work[i];
+	for (; i > 0 && workless(work[(i-1)/2], b); i = (i-1)/2)
+		work[i] = work[(i-1)/2];
+	work[i] = b;
+}
+
+static void
+queue(struct build *build)
+{
+	size_t i;
+
+	if (nwork == workcap) {
+		workcap = workcap ? workcap*2 : 256;
+		work = reallocarray(work, workcap, sizeof *work);
+		if (!work) {
+			perror("reallocarray");
+			exit(1);
+		}
+	}
+	i = nwork++;
+	/* during planning the graph is incomplete, defer ordering to workinit */
+	if (!workheap) {
+		work[i] = build;
+		return;
+	}
+	buildprio(build);
+	work[i] = build;
+	worksiftup(i);
+}
+
+static void
+workremove(size_t i)
+{
+	struct build *build = work[--nwork];
+
+	if (i == nwork)
+		return;
+	work[i] = build;
+	if (i > 0 && workless(work[(i-1)/2], build))
+		worksiftup(i);
+	else
+		worksiftdown(i);
+}
+
+static struct build *
+dequeue(void)
+{
+	struct build *build = work[0];
+	work[0] = work[--nwork];
+	if (nwork > 0)
+		worksiftdown(0);
+	return build;
+}
+
+static void
+workinit(void)
+{
+	for (size_t i = 0; i < nwork; i++)
+		buildprio(work[i]);
+	for (size_t i = nwork/2; i-- > 0;)
+		worksiftdown(i);
+	workheap = true;
+}
+
+static void
+_loaddeps(struct build *build)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (build->flags & FLAG_DEPS)
+		return;
+
+	if (build->dbent) {
+		const struct dbentry *ent = build->dbent;
+		struct builder *builder = build->builder;
+		const uint32_t *ref;
+		if ((uint64_t)ent->refs + ent->nhostdeps + ent->ntargetdeps + ent->nsubpkgs > builder->db->nrefs) {
+			fprintf(stderr, "deps/%s.db: reference out of range\n", buildername(builder));
+			exit(1);
+		}
+		ref = builder->dbrefs + ent->refs;
+		if (*dbstr(builder, ent->version))
+			build->version = (char *)dbstr(builder, ent->version);
+		if (*dbstr(builder, ent->revision))
+			build->revision = (char *)dbstr(builder, ent->revision);
+		for (uint32_t i = 0; i < ent->nhostdeps; i++)
+			addhostdep(build, mkpkgname(dbstr(builder, *ref++)));
+		for (uint32_t i = 0; i < ent->ntargetdeps; i++)
+			addtargetdep(build, mkpkgname(dbstr(builder, *ref++)));
+		for (uint32_t i = 0; i < ent->nsubpkgs; i++)
+			addsubpkg(build, mkpkgname(dbstr(builder, *ref++)));
+		build->flags |= FLAG_DEPS;
+		return;
+	}
+
+	xsnprintf(path, sizeof path, "%s.dep", build->pkgname->name);
+	profcount(PROF_OPEN, 1);
+	profcount(PROF_STAT, 1);
+	int fd = xopenat(build->builder->depfd, build->builder->depdir, path, O_RDONLY);
+	void *buf = NULL;
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "fstat: %s/%s: %s\n", build->builder->depdir, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size > 0 && (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s/%s: %s\n", build->builder->depdir, path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	profcount(PROF_MMAP, st.st_size > 0);
+	profcount(PROF_BYTES, st.st_size);
+	if (readdeps(build, buf, st.st_size) == -1) {
+		fprintf(stderr, "readdeps: %s/%s: %s\n", build->builder->depdir, path, strerror(errno));
+		exit(1);
+	}
+	if (buf)
+		munmap(buf, st.st_size);
+
+	build->flags |= FLAG_DEPS;
+	build->builder->dbdirty = true;
+}
+
+static void
+loaddeps(struct build *build)
+{
+	uint64_t start = profnow();
+
+	_loaddeps(build);
+	proffunc(PROF_LOADDEPS, start);
+}
+
+static size_t maxjobs = 1;
+/* cores shared between the -j of all running build jobs */
+static size_t maxtokens;
+static size_t numtokens;
+
+/* admission control limits, see admit() */
+static double maxload;
+enum { MAXPRESSURE = 10 };
+
+static size_t maxfail = -1;
+static size_t numfail = 0;
+static size_t numfinished = 0;
+
+static bool dryrun = false;
+
+/* packages handled by one xbps-src dbulk-dump, 1 disables streaming */
+static size_t batchsize = 1;
+
+/*
+ * Build output read through a pipe by the event loop instead of written by
+ * the job, see logstart.  Logs longer than logmax keep their head and tail.
+ */
+static bool logpipe;
+static uint64_t logmax;
+static bool logzstd;
+/* bytes of the live tail served on the metrics endpoint */
+enum { LOGTAIL = 8192 };
+/* bytes of the end of a log kept in memory per build job */
+enum { LOGRINGMAX = 1 << 20 };
+
+struct job {
+	size_t next;
+	int status;
+	struct rusage rusage;
+	struct timespec start;
+	uint64_t cost;
+	size_t ntokens;
+	struct build *build;
+	struct masterdir *masterdir;
+	/* remote executor or NULL for local jobs */
+	struct executor *exec;
+	pid_t pid;
+	int pidfd;
+	bool failed;
+	/* killed after the deadline, see jobtimeouts */
+	struct timespec deadline;
+	int timedout;
+	/* own cgroup below cgroupdir, see cgroupstart */
+	char cgroup[32];
+	int cgroupfd;
+	/* left behind by a killed run, see journaladopt */
+	bool adopted;
+
+	/* batched dependency generation, see gendepbatchstart */
+	struct build **batch;
+	size_t nbatch;
+	struct build *cur;
+	int outfd;
+	char *buf;
+	size_t buflen, bufcap, blockstart;
+	struct timespec mark;
+
+	/* piped build output, see logstart */
+	int logfd, logtmp;
+	uint64_t logsize;
+	/* ring of the last output, big enough for the kept tail */
+	char *logring;
+	size_t logringcap;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *logzc;
+#endif
+};
+
+/* epoll event sources, the low 32 bits of the data hold an index */
+enum {
+	EV_SIGNAL,
+	EV_PIDFD,
+	EV_DUMP,
+	EV_METRICS,
+	EV_SCRAPE,
+	EV_WATCH,
+	EV_LOG,
+	EV_EVENTS,
+};
+
+static struct job *jobs;
+static size_t numjobs;
+static size_t freejob;
+
+static int epfd = -1;
+static int sigpipe[2] = {-1, -1};
+static bool usepidfd = true;
+static volatile sig_atomic_t stopping;
+
+static const char *eta(void);
+
+static void
+evadd(int fd, uint32_t type, uint32_t idx)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = (uint64_t)type << 32 | idx,
+	};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+/*
+ * Local jobs can run in their own cgroup below the delegated cgroupdir,
+ * which gets memory.max and cpu.max applied and is killed as a whole.
+ */
+static const char *cgroupdir;
+static int cgroupfd = -1;
+static const char *cgmemmax, *cgcpumax;
+static unsigned cgseq;
+/* cgroups that still had dying processes when their job finished */
+static char **cgstale;
+static size_t ncgstale, cgstalecap;
+
+/* wall clock limit of jobs in seconds, 0 disables it */
+static unsigned long maxtime;
+/* seconds between the timeout signal and killing the job */
+enum { KILLGRACE = 10 };
+
+static bool
+cgwrite(int dirfd, const char *name, const char *value)
+{
+	int fd;
+	bool ok;
+
+	if ((fd = openat(dirfd, name, O_WRONLY|O_CLOEXEC)) == -1)
+		return false;
+	ok = write(fd, value, strlen(value)) != -1;
+	close(fd);
+	return ok;
+}
+
+static ssize_t
+cgread(int dirfd, const char *name, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC)) == -1)
+		return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n >= 0)
+		buf[n] = '\0';
+	return n;
+}
+
+static void
+cgroupinit(void)
+{
+	static const char *const controllers[] = {"+memory", "+cpu", "+io"};
+
+	if ((cgroupfd = open(cgroupdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		fprintf(stderr, "open: %s: %s\n", cgroupdir, strerror(errno));
+		exit(1);
+	}
+	for (size_t i = 0; i < sizeof controllers / sizeof *controllers; i++) {
+		if (!cgwrite(cgroupfd, "cgroup.subtree_control", controllers[i]))
+			fprintf(stderr, "warn: %s/cgroup.subtree_control: cannot enable %s: %s\n", cgroupdir, controllers[i]+1, strerror(errno));
+	}
+}
+
+static int
+cgroupstart(struct job *j)
+{
+	j->cgroupfd = -1;
+	if (cgroupfd == -1 || j->exec)
+		return 0;
+	/* skip the names still used by adopted jobs */
+	for (;;) {
+		xsnprintf(j->cgroup, sizeof j->cgroup, "job%zu.%u", (size_t)(j-jobs), cgseq++);
+		if (mkdirat(cgroupfd, j->cgroup, 0755) == 0)
+			break;
+		if (errno != EEXIST) {
+			fprintf(stderr, "mkdir: %s/%s: %s\n", cgroupdir, j->cgroup, strerror(errno));
+			return -1;
+		}
+	}
+	if ((j->cgroupfd = openat(cgroupfd, j->cgroup, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		fprintf(stderr, "open: %s/%s: %s\n", cgroupdir, j->cgroup, strerror(errno));
+		goto err;
+	}
+	if (cgmemmax && !cgwrite(j->cgroupfd, "memory.max", cgmemmax)) {
+		fprintf(stderr, "write: %s/%s/memory.max: %s\n", cgroupdir, j->cgroup, strerror(errno));
+		goto err;
+	}
+	if (cgcpumax && !cgwrite(j->cgroupfd, "cpu.max", cgcpumax)) {
+		fprintf(stderr, "write: %s/%s/cpu.max: %s\n", cgroupdir, j->cgroup, strerror(errno));
+		goto err;
+	}
+	return 0;
+err:
+	if (j->cgroupfd != -1)
+		close(j->cgroupfd);
+	j->cgroupfd = -1;
+	unlinkat(cgroupfd, j->cgroup, AT_REMOVEDIR);
+	return -1;
+}
+
+/* the job moves itself into its cgroup before running argv */
+static void
+cgroupargv(struct job *j, char *argv[], char *path, size_t len)
+{
+	size_t argc = 0;
+
+	if (j->cgroupfd == -1)
+		return;
+	while (argv[argc])
+		argc++;
+	memmove(argv+4, argv, (argc+1) * sizeof *argv);
+	xsnprintf(path, len, "%s/%s", cgroupdir, j->cgroup);
+	argv[0] = "/bin/sh";
+	argv[1] = "-c";
+	argv[2] = "echo 0 >\"$0/cgroup.procs\" && exec \"$@\"";
+	argv[3] = path;
+}
+
+/* collect the accounting of the finished job and remove its cgroup */
+static void
+cgroupdone(struct job *j, struct hist *h)
+{
+	char buf[4096], *p;
+
+	if (j->cgroupfd == -1)
+		return;
+	if (h && cgread(j->cgroupfd, "cpu.stat", buf, sizeof buf) > 0 &&
+	    (p = strstr(buf, "usage_usec ")))
+		h->cputime = strtoull(p + 11, NULL, 10) / 1000;
+	if (h && cgread(j->cgroupfd, "memory.peak", buf, sizeof buf) > 0)
+		h->maxrss = strtoull(buf, NULL, 10) / 1024;
+	if (h && cgread(j->cgroupfd, "io.stat", buf, sizeof buf) > 0) {
+		uint64_t io = 0;
+		for (p = buf; (p = strstr(p, "bytes=")); p += 6)
+			io += strtoull(p + 6, NULL, 10);
+		h->io = io / 1024;
+	}
+	/* don't leave anything the build started behind */
+	cgwrite(j->cgroupfd, "cgroup.kill", "1");
+	close(j->cgroupfd);
+	j->cgroupfd = -1;
+	if (unlinkat(cgroupfd, j->cgroup, AT_REMOVEDIR) == -1) {
+		cgstale = grow(cgstale, ncgstale, &cgstalecap, sizeof *cgstale);
+		cgstale[ncgstale++] = xstrdup(j->cgroup);
+	}
+}
+
+static void
+cgroupfini(void)
+{
+	for (size_t i = 0; i < ncgstale; i++) {
+		if (unlinkat(cgroupfd, cgstale[i], AT_REMOVEDIR) == -1)
+			fprintf(stderr, "warn: rmdir: %s/%s: %s\n", cgroupdir, cgstale[i], strerror(errno));
+		free(cgstale[i]);
+	}
+	free(cgstale);
+	cgstale = NULL;
+	ncgstale = cgstalecap = 0;
+}
+
+/* journaled jobs lead their own process group, see journalargv */
+static void
+jobsignal(pid_t pid, int sig)
+{
+	if (kill(-pid, sig) == -1)
+		kill(pid, sig);
+}
+
+/* signal every process in a cgroup, cgroup.kill only knows SIGKILL */
+static bool
+cgsignal(int dirfd, int sig)
+{
+	FILE *fp;
+	int fd, pid;
+
+	if ((fd = openat(dirfd, "cgroup.procs", O_RDONLY|O_CLOEXEC)) == -1)
+		return false;
+	if (!(fp = fdopen(fd, "r"))) {
+		close(fd);
+		return false;
+	}
+	while (fscanf(fp, "%d", &pid) == 1)
+		kill(pid, sig);
+	fclose(fp);
+	return true;
+}
+
+/* signal a job that ran past the timeout, killing it after the grace period */
+static void
+jobkill(struct job *j)
+{
+	if (j->timedout++ == 0)
+		fprintf(stderr, "job timed out after %lus: %s\n", maxtime, j->build->pkgname->name);
+	if (j->timedout == 1) {
+		/* give xbps-src the grace period to clean up its masterdir */
+		if (j->cgroupfd == -1 || !cgsignal(j->cgroupfd, SIGTERM))
+			jobsignal(j->pid, SIGTERM);
+	} else if (j->cgroupfd == -1 || !cgwrite(j->cgroupfd, "cgroup.kill", "1")) {
+		jobsignal(j->pid, SIGKILL);
+	}
+	j->deadline.tv_sec += KILLGRACE;
+}
+
+/* enforce the timeout, returns the milliseconds until the next one is due or -1 */
+static int
+jobtimeouts(void)
+{
+	struct timespec now;
+	int next = -1;
+
+	if (maxtime == 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (size_t i = 0; i < numslots; i++) {
+		struct job *j = &jobs[i];
+		long ms;
+		if (j->pid <= 0)
+			continue;
+		ms = (j->deadline.tv_sec - now.tv_sec) * 1000 + (j->deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0) {
+			jobkill(j);
+			ms = KILLGRACE * 1000;
+		}
+		if (next == -1 || ms < next)
+			next = ms;
+	}
+	return next;
+}
+
+/*
+ * With -L or -z the output of build jobs goes through a pipe.  The first
+ * half of logmax is written as it arrives, a ring keeps the last output
+ * for the second half and the live tail, and the part in between is
+ * dropped when the job is done.  The ring is held in memory for each
+ * running build, so it is capped at LOGRINGMAX and a larger logmax goes
+ * to the head instead.  For -z the log is zstd compressed, read it with
+ * zstdcat.  The .tmp, .log and .err names stay the same.
+ */
+
+/* bytes written from the start of a log, the ring keeps the rest of logmax */
+static uint64_t
+loghead(void)
+{
+	uint64_t tail = logmax - logmax / 2;
+
+	if (logmax == 0)
+		return UINT64_MAX;
+	return logmax - (tail < LOGRINGMAX ? tail : LOGRINGMAX);
+}
+static void
+logwriteall(struct job *j, const char *buf, size_t len)
+{
+	struct build *build = j->build;
+
+	while (len > 0 && j->logtmp != -1) {
+		ssize_t n = write(j->logtmp, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			/* keep reading the pipe, the job must not block */
+			fprintf(stderr, "warn: write: %s/%s-%s_%s.tmp: %s, log truncated\n", build->builder->logdir,
+			    build->pkgname->name, build->version, build->revision, strerror(errno));
+			close(j->logtmp);
+			j->logtmp = -1;
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+#ifdef HAVE_ZSTD
+static void
+logcompress(struct job *j, const char *buf, size_t len, ZSTD_EndDirective mode)
+{
+	static char *zbuf;
+	static size_t zbufsz;
+	ZSTD_inBuffer in = {buf, len, 0};
+	size_t left;
+
+	if (!zbuf) {
+		zbufsz = ZSTD_CStreamOutSize();
+		zbuf = xzmalloc(zbufsz);
+	}
+	do {
+		ZSTD_outBuffer out = {zbuf, zbufsz, 0};
+		left = ZSTD_compressStream2(j->logzc, &out, &in, mode);
+		if (ZSTD_isError(left)) {
+			fprintf(stderr, "ZSTD_compressStream2: %s\n", ZSTD_getErrorName(left));
+			exit(1);
+		}
+		logwriteall(j, zbuf, out.pos);
+	} while (mode == ZSTD_e_end ? left != 0 : in.pos < in.size);
+}
+#endif
+
+static void
+logemit(struct job *j, const char *buf, size_t len)
+{
+#ifdef HAVE_ZSTD
+	if (j->logzc) {
+		logcompress(j, buf, len, ZSTD_e_continue);
+		return;
+	}
+#endif
+	logwriteall(j, buf, len);
+}
+
+/* the last n bytes of output start at ring[*off], returns the length up to the wrap */
+static size_t
+logspan(const struct job *j, size_t n, size_t *off)
+{
+	*off = (j->logsize - n) % j->logringcap;
+	return n < j->logringcap - *off ? n : j->logringcap - *off;
+}
+
+static void
+logput(struct job *j, const char *buf, size_t len)
+{
+	uint64_t head = loghead();
+	size_t off, n;
+
+	if (j->logsize < head)
+		logemit(j, buf, len < head - j->logsize ? len : head - j->logsize);
+	j->logsize += len;
+	if (len > j->logringcap) {
+		buf += len - j->logringcap;
+		len = j->logringcap;
+	}
+	n = logspan(j, len, &off);
+	memcpy(j->logring + off, buf, n);
+	memcpy(j->logring, buf + n, len - n);
+}
+
+/* returns whether there may be more to read */
+static bool
+logread(struct job *j)
+{
+	char buf[65536];
+
+	/* a chatty job must not starve the event loop */
+	for (int i = 0; i < 16; i++) {
+		ssize_t n = read(j->logfd, buf, sizeof buf);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return false;
+			perror("read");
+			exit(1);
+		}
+		if (n == 0) {
+			close(j->logfd);
+			j->logfd = -1;
+			return false;
+		}
+		logput(j, buf, n);
+	}
+	return true;
+}
+
+static void
+logstart(struct job *j, int tmpfd, int fd)
+{
+	uint64_t tail = logmax > 0 ? logmax - loghead() : 0;
+
+	j->logfd = fd;
+	j->logtmp = tmpfd;
+	j->logsize = 0;
+	j->logringcap = tail > LOGTAIL ? tail : LOGTAIL;
+	j->logring = xzmalloc(j->logringcap);
+#ifdef HAVE_ZSTD
+	if (logzstd && !(j->logzc = ZSTD_createCCtx())) {
+		fprintf(stderr, "ZSTD_createCCtx: failed\n");
+		exit(1);
+	}
+#endif
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+	evadd(fd, EV_LOG, j-jobs);
+}
+
+/* the job has exited, everything it wrote is in the pipe */
+static void
+logfinish(struct job *j)
+{
+	uint64_t head = loghead();
+	char mark[128];
+	size_t off, n;
+
+	while (j->logfd != -1 && logread(j))
+		;
+	/* left open by a background process of the job */
+	if (j->logfd != -1) {
+		close(j->logfd);
+		j->logfd = -1;
+	}
+	if (j->logsize > head) {
+		uint64_t after = j->logsize - head;
+		size_t keep = logmax - head;
+		if (after > keep) {
+			xsnprintf(mark, sizeof mark, "\n[%" PRIu64 " bytes of output omitted]\n", after - keep);
+			logemit(j, mark, strlen(mark));
+		} else {
+			keep = after;
+		}
+		n = logspan(j, keep, &off);
+		logemit(j, j->logring + off, n);
+		logemit(j, j->logring, keep - n);
+	}
+#ifdef HAVE_ZSTD
+	if (j->logzc) {
+		logcompress(j, NULL, 0, ZSTD_e_end);
+		ZSTD_freeCCtx(j->logzc);
+		j->logzc = NULL;
+	}
+#endif
+	if (j->logtmp != -1) {
+		close(j->logtmp);
+		j->logtmp = -1;
+	}
+	free(j->logring);
+	j->logring = NULL;
+}
+
+/*
+ * Structured progress: JSON lines written to a file or a unix socket, and
+ * a Prometheus text endpoint served from the event loop.
+ */
+static const char *eventpath;
+static int eventsfd = -1;
+static bool eventsock;
+/* events the socket did not take yet, dropped beyond EVENTMAX */
+static char *eventbuf;
+static size_t eventlen, eventcap, eventdrops;
+static bool eventwait;
+enum { EVENTMAX = 1 << 20 };
+static const char *metricsaddr;
+static int metricsfd = -1;
+static struct timespec runstart, nextstatus;
+/* seconds between status events */
+enum { STATUSINTERVAL = 10 };
+
+/* output being assembled for an event or a metrics response */
+static char *outbuf;
+static size_t outlen, outcap;
+
+static void
+outprintf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(outbuf + outlen, outcap - outlen, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			perror("vsnprintf");
+			exit(1);
+		}
+		if ((size_t)n < outcap - outlen)
+			break;
+		while (outcap - outlen <= (size_t)n)
+			outbuf = grow(outbuf, outcap, &outcap, 1);
+	}
+	outlen += n;
+}
+
+static void
+outbytes(const char *buf, size_t len)
+{
+	while (outcap - outlen < len)
+		outbuf = grow(outbuf, outcap, &outcap, 1);
+	memcpy(outbuf + outlen, buf, len);
+	outlen += len;
+}
+
+static void
+outjson(const char *key, const char *s)
+{
+	outprintf("\"%s\":\"", key);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			outprintf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			outprintf("\\u%04x", *s);
+		else
+			outprintf("%c", *s);
+	}
+	outprintf("\"");
+}
+
+static bool
+outsend(int fd, bool sock)
+{
+	size_t off = 0;
+
+	while (off < outlen) {
+		ssize_t n = sock ? send(fd, outbuf + off, outlen - off, MSG_NOSIGNAL) : write(fd, outbuf + off, outlen - off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			outlen = 0;
+			return false;
+		}
+		off += n;
+	}
+	outlen = 0;
+	return true;
+}
+
+static double
+elapsed(const struct timespec *since, const struct timespec *now)
+{
+	return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static const char *
+jobkind(const struct job *j)
+{
+	if (j->build->flags & FLAG_FETCH)
+		return "fetch";
+	return j->build->flags & FLAG_DEPS ? "build" : "deps";
+}
+
+static void
+eventopen(void)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct stat st;
+
+	if (stat(eventpath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (strlen(eventpath) >= sizeof sa.sun_path) {
+			fprintf(stderr, "socket: %s: path too long\n", eventpath);
+			exit(1);
+		}
+		strcpy(sa.sun_path, eventpath);
+		/* a reader that stops reading must not stall the run */
+		if ((eventsfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)) == -1) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(eventsfd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+			fprintf(stderr, "connect: %s: %s\n", eventpath, strerror(errno));
+			exit(1);
+		}
+		eventsock = true;
+	} else if ((eventsfd = open(eventpath, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644)) == -1) {
+		fprintf(stderr, "open: %s: %s\n", eventpath, strerror(errno));
+		exit(1);
+	}
+}
+
+/* starts an event line, finished by eventend */
+static bool
+eventbegin(const char *type)
+{
+	struct timespec now;
+
+	if (eventsfd == -1)
+		return false;
+	clock_gettime(CLOCK_REALTIME, &now);
+	outlen = 0;
+	outprintf("{\"time\":%.3f,", now.tv_sec + now.tv_nsec / 1e9);
+	outjson("event", type);
+	return true;
+}
+
+static void
+eventclose(void)
+{
+	fprintf(stderr, "warn: write: %s: %s, events disabled\n", eventpath, strerror(errno));
+	close(eventsfd);
+	eventsfd = -1;
+	eventwait = false;
+	eventlen = 0;
+}
+
+/* send the buffered events, waits for EPOLLOUT once the socket is full */
+static void
+eventflush(void)
+{
+	struct epoll_event ev;
+	size_t off = 0;
+
+	while (off < eventlen) {
+		ssize_t n = send(eventsfd, eventbuf + off, eventlen - off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				eventclose();
+				return;
+			}
+			break;
+		}
+		off += n;
+	}
+	memmove(eventbuf, eventbuf + off, eventlen - off);
+	eventlen -= off;
+	/* before the event loop the next event tries again */
+	if (epfd == -1 || eventwait == (eventlen > 0))
+		return;
+	ev.events = EPOLLOUT;
+	ev.data.u64 = (uint64_t)EV_EVENTS << 32;
+	if (epoll_ctl(epfd, eventlen > 0 ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, eventsfd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	eventwait = eventlen > 0;
+	if (eventlen == 0 && eventdrops > 0) {
+		fprintf(stderr, "warn: %s: dropped %zu events of a slow reader\n", eventpath, eventdrops);
+		eventdrops = 0;
+	}
+}
+
+static void
+eventend(void)
+{
+	outprintf("}\n");
+	if (!eventsock) {
+		if (!outsend(eventsfd, false))
+			eventclose();
+		return;
+	}
+	/* whole events only, the lines stay intact */
+	if (eventlen + outlen > EVENTMAX) {
+		if (eventdrops++ == 0)
+			fprintf(stderr, "warn: %s: reader is not keeping up, dropping events\n", eventpath);
+		outlen = 0;
+		return;
+	}
+	while (eventcap - eventlen < outlen)
+		eventbuf = grow(eventbuf, eventcap, &eventcap, 1);
+	memcpy(eventbuf + eventlen, outbuf, outlen);
+	eventlen += outlen;
+	outlen = 0;
+	if (!eventwait)
+		eventflush();
+}
+
+static void
+eventbuild(const char *type, struct build *build)
+{
+	if (!eventbegin(type))
+		return;
+	outprintf(",");
+	outjson("pkg", build->pkgname->name);
+	outprintf(",");
+	outjson("builder", buildername(build->builder));
+}
+
+static void
+eventjob(const char *type, struct job *j, const char *kind)
+{
+	struct timespec now;
+
+	if (eventsfd == -1)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	eventbuild(type, j->build);
+	outprintf(",");
+	outjson("kind", kind);
+	outprintf(",\"slot\":%zu", (size_t)(j-jobs));
+	if (j->nbatch > 0)
+		outprintf(",\"batch\":%zu", j->nbatch);
+	if (j->exec) {
+		outprintf(",");
+		outjson("host", j->exec->host);
+	}
+	if (strcmp(type, "finish") == 0) {
+		outprintf(",\"elapsed\":%.3f,", elapsed(&j->start, &now));
+		outjson("status", j->timedout ? "timeout" : j->failed ? "failed" : "ok");
+	}
+	eventend();
+}
+
+static void
+eventskip(struct build *build, const char *cause)
+{
+	if (eventsfd == -1)
+		return;
+	eventbuild("skip", build);
+	outprintf(",");
+	outjson("cause", cause);
+	eventend();
+}
+
+/* builds waiting for dependencies, neither ready nor running */
+static size_t
+numblocked(void)
+{
+	size_t busy = numfinished + nwork;
+
+	for (size_t i = 0; i < numslots; i++) {
+		if (jobs[i].pid > 0)
+			busy += jobs[i].nbatch > 0 ? jobs[i].nbatch : 1;
+	}
+	return numtotal > busy ? numtotal - busy : 0;
+}
+
+static void
+eventstatus(void)
+{
+	struct timespec now;
+	double secs;
+	bool first = true;
+
+	if (eventsfd == -1)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nextstatus = now;
+	nextstatus.tv_sec += STATUSINTERVAL;
+	secs = elapsed(&runstart, &now);
+	eventbegin("status");
+	outprintf(",\"running\":%zu,\"slots\":%zu,\"ready\":%zu,\"blocked\":%zu,\"finished\":%zu,\"failed\":%zu,\"total\":%zu",
+	    numjobs, numslots, nwork, numblocked(), numfinished, numfail, numtotal);
+	outprintf(",\"throughput\":%.3f,\"jobs\":[", secs > 0 ? numfinished / secs * 60 : 0.0);
+	for (size_t i = 0; i < numslots; i++) {
+		struct job *j = &jobs[i];
+		if (j->pid <= 0)
+			continue;
+		outprintf("%s{", first ? "" : ",");
+		outjson("pkg", j->build->pkgname->name);
+		outprintf(",");
+		outjson("builder", buildername(j->build->builder));
+		outprintf(",");
+		outjson("kind", jobkind(j));
+		outprintf(",\"elapsed\":%.3f}", elapsed(&j->start, &now));
+		first = false;
+	}
+	outprintf("]");
+	eventend();
+}
+
+/* milliseconds until the next status event is due, or -1 */
+static int
+eventtimeout(void)
+{
+	struct timespec now;
+	long ms;
+
+	if (eventsfd == -1)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (nextstatus.tv_sec - now.tv_sec) * 1000 + (nextstatus.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms <= 0) {
+		eventstatus();
+		ms = STATUSINTERVAL * 1000;
+	}
+	return ms;
+}
+
+static void
+metricsinit(void)
+{
+	struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_socktype = SOCK_STREAM }, *ai;
+	char host[256];
+	const char *port = strrchr(metricsaddr, ':');
+	int one = 1, err;
+
+	if (port) {
+		xsnprintf(host, sizeof host, "%.*s", (int)(port - metricsaddr), metricsaddr);
+		port++;
+	} else {
+		port = metricsaddr;
+	}
+	if ((err = getaddrinfo(port != metricsaddr && host[0] ? host : NULL, port, &hints, &ai))) {
+		fprintf(stderr, "getaddrinfo: %s: %s\n", metricsaddr, gai_strerror(err));
+		exit(1);
+	}
+	if ((metricsfd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(metricsfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if (bind(metricsfd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(metricsfd, 16) == -1) {
+		fprintf(stderr, "bind: %s: %s\n", metricsaddr, strerror(errno));
+		exit(1);
+	}
+	freeaddrinfo(ai);
+	evadd(metricsfd, EV_METRICS, 0);
+}
+
+static void
+metricsaccept(void)
+{
+	int fd;
+
+	while ((fd = accept4(metricsfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1)
+		evadd(fd, EV_SCRAPE, fd);
+}
+
+/* responses that did not fit into the socket buffer, see scrapeflush */
+static struct scrape {
+	int fd;
+	char *buf;
+	size_t len, off;
+} *scrapes;
+static size_t nscrapes, scrapescap;
+
+/* send the response and close the connection, or finish it on EPOLLOUT */
+static void
+scrapesend(int fd)
+{
+	size_t off = 0;
+
+	while (off < outlen) {
+		ssize_t n = send(fd, outbuf + off, outlen - off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				struct epoll_event ev = {
+					.events = EPOLLOUT,
+					.data.u64 = (uint64_t)EV_SCRAPE << 32 | fd,
+				};
+				if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+					perror("epoll_ctl");
+					exit(1);
+				}
+				scrapes = grow(scrapes, nscrapes, &scrapescap, sizeof *scrapes);
+				scrapes[nscrapes] = (struct scrape){ .fd = fd, .len = outlen - off };
+				scrapes[nscrapes].buf = xzmalloc(outlen - off);
+				memcpy(scrapes[nscrapes].buf, outbuf + off, outlen - off);
+				nscrapes++;
+				outlen = 0;
+				return;
+			}
+			break;
+		}
+		off += n;
+	}
+	outlen = 0;
+	close(fd);
+}
+
+/* returns whether the connection has a response pending */
+static bool
+scrapeflush(int fd)
+{
+	struct scrape *sc = NULL;
+
+	for (size_t i = 0; i < nscrapes; i++) {
+		if (scrapes[i].fd == fd)
+			sc = &scrapes[i];
+	}
+	if (!sc)
+		return false;
+	while (sc->off < sc->len) {
+		ssize_t n = send(fd, sc->buf + sc->off, sc->len - sc->off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return true;
+			break;
+		}
+		sc->off += n;
+	}
+	close(fd);
+	free(sc->buf);
+	*sc = scrapes[--nscrapes];
+	return true;
+}
+
+/* the live output of the build in a slot, see logstart */
+static void
+metricstail(int fd, size_t slot)
+{
+	struct job *j = slot < numslots ? &jobs[slot] : NULL;
+	size_t len, off, n;
+
+	outlen = 0;
+	if (!j || j->pid <= 0 || !j->logring) {
+		outprintf("HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nno build output in slot %zu\n", slot);
+	} else {
+		len = j->logsize < LOGTAIL ? j->logsize : LOGTAIL;
+		n = logspan(j, len, &off);
+		outprintf("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+		outbytes(j->logring + off, n);
+		outbytes(j->logring, len - n);
+	}
+	scrapesend(fd);
+}
+
+/* answer GET /tail/<slot> with the live tail, anything else with the metrics */
+static void
+metricsscrape(int fd)
+{
+	static const char *const kinds[] = {"build", "deps", "fetch"};
+	char req[4096];
+	struct timespec now;
+	size_t busy = 0, local = 0, len = 0, slot;
+	ssize_t n;
+
+	while (len < sizeof req - 1 && (n = read(fd, req + len, sizeof req - 1 - len)) > 0)
+		len += n;
+	req[len] = '\0';
+	if (sscanf(req, "GET /tail/%zu", &slot) == 1) {
+		metricstail(fd, slot);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	outlen = 0;
+	outprintf("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+	for (size_t i = 0; i < numslots; i++) {
+		if (jobs[i].pid > 0)
+			busy++;
+	}
+	for (struct executor *ex = executors; ex; ex = ex->next)
+		local += ex->slots;
+	local = numslots - local;
+	outprintf("# TYPE xbps_dbulk_slots gauge\n");
+	outprintf("xbps_dbulk_slots{location=\"local\"} %zu\n", local);
+	outprintf("xbps_dbulk_slots{location=\"remote\"} %zu\n", numslots - local);
+	outprintf("# TYPE xbps_dbulk_slots_busy gauge\nxbps_dbulk_slots_busy %zu\n", busy);
+	outprintf("# TYPE xbps_dbulk_jobs_running gauge\n");
+	for (size_t k = 0; k < sizeof kinds / sizeof *kinds; k++) {
+		size_t n = 0;
+		for (size_t i = 0; i < numslots; i++) {
+			if (jobs[i].pid > 0 && strcmp(jobkind(&jobs[i]), kinds[k]) == 0)
+				n++;
+		}
+		outprintf("xbps_dbulk_jobs_running{kind=\"%s\"} %zu\n", kinds[k], n);
+	}
+	outprintf("# TYPE xbps_dbulk_cores gauge\nxbps_dbulk_cores %zu\n", maxtokens);
+	outprintf("# TYPE xbps_dbulk_cores_busy gauge\nxbps_dbulk_cores_busy %zu\n", numtokens);
+	outprintf("# TYPE xbps_dbulk_builds_ready gauge\nxbps_dbulk_builds_ready %zu\n", nwork);
+	outprintf("# TYPE xbps_dbulk_builds_blocked gauge\nxbps_dbulk_builds_blocked %zu\n", numblocked());
+	outprintf("# TYPE xbps_dbulk_builds gauge\nxbps_dbulk_builds %zu\n", numtotal);
+	outprintf("# TYPE xbps_dbulk_builds_finished_total counter\nxbps_dbulk_builds_finished_total %zu\n", numfinished);
+	outprintf("# TYPE xbps_dbulk_builds_failed_total counter\nxbps_dbulk_builds_failed_total %zu\n", numfail);
+	outprintf("# TYPE xbps_dbulk_eta_seconds gauge\nxbps_dbulk_eta_seconds %" PRIu64 "\n", remaining / numslots / 1000);
+	outprintf("# TYPE xbps_dbulk_uptime_seconds counter\nxbps_dbulk_uptime_seconds %.3f\n", elapsed(&runstart, &now));
+	outprintf("# TYPE xbps_dbulk_job_elapsed_seconds gauge\n");
+	for (size_t i = 0; i < numslots; i++) {
+		struct job *j = &jobs[i];
+		if (j->pid <= 0)
+			continue;
+		outprintf("xbps_dbulk_job_elapsed_seconds{slot=\"%zu\",kind=\"%s\",builder=\"%s\",pkg=\"%s\"} %.3f\n",
+		    i, jobkind(j), buildername(j->build->builder), j->build->pkgname->name, elapsed(&j->start, &now));
+	}
+	if (logpipe) {
+		outprintf("# TYPE xbps_dbulk_job_log_bytes gauge\n");
+		for (size_t i = 0; i < numslots; i++) {
+			struct job *j = &jobs[i];
+			if (j->pid <= 0 || !j->logring)
+				continue;
+			outprintf("xbps_dbulk_job_log_bytes{slot=\"%zu\",builder=\"%s\",pkg=\"%s\"} %" PRIu64 "\n",
+			    i, buildername(j->build->builder), j->build->pkgname->name, j->logsize);
+		}
+	}
+	scrapesend(fd);
+}
+
+static int buildadd(struct pkgname *pkgname, struct builder *builder);
+static bool fetchwanted(struct build *build);
+static void fetchqueue(struct build *build);
+static void pkgnamedone(struct pkgname *pkgname, struct builder *builder, bool prune);
+static void buildpruned(struct build *build, struct pkgname *cause);
+static void buildfailed(struct build *build);
+static void failure(void);
+static void journalargv(struct job *j, char *argv[], char *path, size_t len);
+static int jobspawn(struct job *j, char *argv[], const posix_spawn_file_actions_t *actions);
+static void replanusers(struct build *build);
+static void recount(struct build *build);
+static void fetchdeps(struct build *build);
+
+/* add a build back to the graph after its dependencies were regenerated */
+static void
+depdone(struct build *build)
+{
+	build->flags &= ~(FLAG_WORK|FLAG_PRIO);
+	depstat(build);
+	buildadd(build->pkgname, build->builder);
+	/* dependents were waiting on the dependency generation, release
+	 * them if the package turned out to be up to date */
+	if ((build->flags & (FLAG_FETCH|FLAG_DIRTY)) == FLAG_FETCH && fetchwanted(build)) {
+		/* or keep them waiting until the package is fetched */
+		fetchqueue(build);
+	} else if (!(build->flags & FLAG_DIRTY)) {
+		pkgnamedone(build->pkgname, build->builder, false);
+		for (size_t i = 0; i < build->nsubpkgs; i++)
+			pkgnamedone(build->subpkgs[i], build->builder, false);
+	} else if (build->flags & FLAG_SKIP) {
+		buildfailed(build);
+	}
+	replanusers(build);
+}
+
+static void
+gendepdone(struct job *j)
+{
+	char path1[PATH_MAX], path2[PATH_MAX];
+	struct build *build = j->build;
+	struct builder *builder = build->builder;
+	const char *name = build->pkgname->name;
+
+	if (WIFEXITED(j->status) && WEXITSTATUS(j->status) != 0) {
+		fprintf(stderr, "job failed: %s\n", name);
+		j->failed = true;
+	}
+
+	if (j->failed) {
+		xsnprintf(path1, sizeof path1, "%s.dep.tmp", name);
+		xunlinkat(builder->depfd, builder->depdir, path1);
+		xsnprintf(path1, sizeof path1, "%s.err.tmp", name);
+		xsnprintf(path2, sizeof path2, "%s.err", name);
+		xrenameat(builder->depfd, builder->depdir, path1, path2);
+		buildfailed(build);
+	} else {
+		xsnprintf(path1, sizeof path1, "%s.err.tmp", name);
+		xunlinkat(builder->depfd, builder->depdir, path1);
+		xsnprintf(path1, sizeof path1, "%s.dep.tmp", name);
+		xsnprintf(path2, sizeof path2, "%s.dep", name);
+		xrenameat(builder->depfd, builder->depdir, path1, path2);
+
+		depdone(build);
+	}
+}
+
+static int
+gendepstart(struct job *j, struct build *build)
+{
+	extern char **environ;
+	char path[PATH_MAX], xbpssrc[PATH_MAX];
+	char cgpath[PATH_MAX], stpath[PATH_MAX];
+	posix_spawn_file_actions_t actions;
+	char *argv[32];
+	int argc, stdoutfd, stderrfd;
+
+	j->failed = false;
+	j->build = build;
+	j->status = 0;
+
+	xsnprintf(path, sizeof path, "%s.dep.tmp", build->pkgname->name);
+	stdoutfd = xopenat(build->builder->depfd, build->builder->depdir, path, O_WRONLY|O_CREAT|O_TRUNC);
+	xsnprintf(path, sizeof path, "%s.err.tmp", build->pkgname->name);
+	stderrfd = xopenat(build->builder->depfd, build->builder->depdir, path, O_WRONLY|O_CREAT|O_TRUNC);
+
+	argc = xbpssrcargs(argv, xbpssrc, sizeof xbpssrc, build->builder, NULL, NULL);
+	argv[argc++] = "dbulk-dump";
+	argv[argc++] = build->pkgname->name;
+	argv[argc] = NULL;
+	journalargv(j, argv, stpath, sizeof stpath);
+	cgroupargv(j, argv, cgpath, sizeof cgpath);
+
+	if ((errno = posix_spawn_file_actions_init(&actions))) {
+		perror("posix_spawn_file_actions_init");
+		goto err1;
+	}
+	if ((errno = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0))) {
+		perror("posix_spawn_file_actions_addopen");
+		goto err2;
+	}
+	if ((errno = posix_spawn_file_actions_adddup2(&actions, stdoutfd, 1))) {
+		perror("posix_spawn_file_actions_adddup2");
+		goto err2;
+	}
+	if ((errno = posix_spawn_file_actions_adddup2(&actions, stderrfd, 2))) {
+		perror("posix_spawn_file_actions_adddup2");
+		goto err2;
+	}
+	if ((errno = jobspawn(j, argv, &actions))) {
+		fprintf(stderr, "posix_spawn: %s: %s\n", build->pkgname->name, strerror(errno));
+		goto err2;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	close(stdoutfd);
+	close(stderrfd);
+
+	return 0;
+
+err2:
+	posix_spawn_file_actions_destroy(&actions);
+err1:
+	close(stdoutfd);
+	close(stderrfd);
+err0:
+	return -1;
+}
+
+static bool
+writefileat(int dirfd, const char *dir, const char *name, const char *buf, size_t len)
+{
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) == -1) {
+		fprintf(stderr, "open: %s/%s: %s\n", dir, name, strerror(errno));
+		return false;
+	}
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "write: %s/%s: %s\n", dir, name, strerror(errno));
+			close(fd);
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	close(fd);
+	return true;
+}
+
+/* a build of the batch finished, successful or not */
+static void
+batchfinish(struct job *j, struct build *build, const char *buf, size_t len, bool ok)
+{
+	char path1[PATH_MAX], path2[PATH_MAX];
+	struct builder *builder = build->builder;
+	const char *name = build->pkgname->name;
+	struct timespec now;
+	struct hist h;
+	uint64_t cost = buildcost(build);
+
+	for (size_t i = 0; i < j->nbatch; i++) {
+		if (j->batch[i] == build)
+			j->batch[i] = NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	h.duration = (now.tv_sec - j->mark.tv_sec) * 1000 + (now.tv_nsec - j->mark.tv_nsec) / 1000000;
+	if (h.duration == 0)
+		h.duration = 1;
+	h.maxrss = 0;
+	h.cputime = h.io = 0;
+	h.cores = 1;
+	h.status = ok ? 0 : j->status ? j->status : 1 << 8;
+	j->mark = now;
+	histrecord(build, HIST_DEPS, &h);
+
+	numfinished++;
+	remaining -= cost < remaining ? cost : remaining;
+
+	xsnprintf(path1, sizeof path1, "%s.%s.tmp", name, ok ? "dep" : "err");
+	xsnprintf(path2, sizeof path2, "%s.%s", name, ok ? "dep" : "err");
+	if (!writefileat(builder->depfd, builder->depdir, path1, buf, len))
+		exit(1);
+	xrenameat(builder->depfd, builder->depdir, path1, path2);
+	if (ok) {
+		fprintf(stderr, "[%zu/%zu eta %s] generated dependencies for %s\n", numfinished, numtotal, eta(), name);
+		/* the dump is still in memory, skip reading the file back */
+		if (readdeps(build, buf, len) == -1) {
+			fprintf(stderr, "readdeps: %s/%s: %s\n", builder->depdir, path2, strerror(errno));
+			exit(1);
+		}
+		build->flags |= FLAG_DEPS;
+		builder->dbdirty = true;
+		depdone(build);
+	} else {
+		fprintf(stderr, "job failed: %s\n", name);
+		failure();
+		buildfailed(build);
+	}
+}
+
+/*
+ * Split the dbulk-dump stream into the per package dependency files, each
+ * package starts with its pkgname line.  Complete packages are added back
+ * to the graph right away so their builds can start while the rest of the
+ * batch is still being dumped.
+ */
+static void
+batchparse(struct job *j, bool eof)
+{
+	size_t off = j->blockstart;
+
+	for (;;) {
+		char *nl = memchr(j->buf+off, '\n', j->buflen-off);
+		size_t end = nl ? (size_t)(nl-j->buf)+1 : j->buflen;
+		if (!nl && !eof)
+			break;
+		if (off == end)
+			break;
+		if (end-off > 9 && strncmp(j->buf+off, "pkgname: ", 9) == 0) {
+			char name[PATH_MAX];
+			size_t len = end-off-9 - (nl ? 1 : 0);
+			if (j->cur && off > j->blockstart)
+				batchfinish(j, j->cur, j->buf+j->blockstart, off-j->blockstart, true);
+			j->cur = NULL;
+			j->blockstart = off;
+			if (len < sizeof name) {
+				memcpy(name, j->buf+off+9, len);
+				name[len] = '\0';
+				for (size_t i = 0; i < j->nbatch; i++) {
+					if (j->batch[i] && strcmp(j->batch[i]->pkgname->name, name) == 0)
+						j->cur = j->batch[i];
+				}
+			}
+			if (!j->cur)
+				fprintf(stderr, "warn: dbulk-dump: unexpected package `%.*s'\n", (int)len, j->buf+off+9);
+		}
+		off = end;
+	}
+	/* keep only the block that is still incomplete */
+	if (j->blockstart > 0) {
+		memmove(j->buf, j->buf+j->blockstart, j->buflen-j->blockstart);
+		j->buflen -= j->blockstart;
+		j->blockstart = 0;
+	}
+}
+
+static void
+batchread(struct job *j)
+{
+	for (;;) {
+		ssize_t n;
+		if (j->bufcap - j->buflen < 4096) {
+			j->bufcap = j->bufcap ? j->bufcap*2 : 16384;
+			if (!(j->buf = realloc(j->buf, j->bufcap))) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		n = read(j->outfd, j->buf+j->buflen, j->bufcap-j->buflen);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			perror("read");
+			exit(1);
+		}
+		if (n == 0) {
+			close(j->outfd);
+			j->outfd = -1;
+			break;
+		}
+		j->buflen += n;
+	}
+	batchparse(j, false);
+}
+
+static void
+gendepbatchdone(struct job *j)
+{
+	char path[PATH_MAX];
+	char *err = NULL;
+	size_t errlen = 0;
+	FILE *fp;
+	bool ok = WIFEXITED(j->status) && WEXITSTATUS(j->status) == 0 && !j->failed;
+
+	/* the child is gone, pick up what is left in the pipe */
+	if (j->outfd != -1) {
+		batchread(j);
+		if (j->outfd != -1) {
+			close(j->outfd);
+			j->outfd = -1;
+		}
+	}
+	if (ok) {
+		batchparse(j, true);
+		if (j->cur)
+			batchfinish(j, j->cur, j->buf, j->buflen, true);
+	}
+
+	xsnprintf(path, sizeof path, "batch.%zu.err.tmp", (size_t)(j-jobs));
+	int errfd = openat(j->build->builder->depfd, path, O_RDONLY|O_CLOEXEC);
+	if (errfd != -1 && (fp = fdopen(errfd, "r"))) {
+		char chunk[4096];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof chunk, fp)) > 0) {
+			if (!(err = realloc(err, errlen+n))) {
+				perror("realloc");
+				exit(1);
+			}
+			memcpy(err+errlen, chunk, n);
+			errlen += n;
+		}
+		fclose(fp);
+	}
+	xunlinkat(j->build->builder->depfd, j->build->builder->depdir, path);
+
+	/* retry what wasn't dumped on its own to find out which one failed */
+	size_t left = 0;
+	for (size_t i = 0; i < j->nbatch; i++) {
+		if (j->batch[i])
+			left++;
+	}
+	for (size_t i = 0; i < j->nbatch; i++) {
+		struct build *b;
+		if (!(b = j->batch[i]))
+			continue;
+		if (left > 1) {
+			b->flags |= FLAG_SOLO;
+			queue(b);
+		} else {
+			batchfinish(j, b, err ? err : "", errlen, false);
+		}
+	}
+	free(err);
+	j->cur = NULL;
+	j->buflen = j->blockstart = 0;
+	j->nbatch = 0;
+}
+
+static int
+gendepbatchstart(struct job *j, struct build *build)
+{
+	extern char **environ;
+	char path[PATH_MAX], errpath[PATH_MAX], cgpath[PATH_MAX];
+	posix_spawn_file_actions_t actions;
+	char **argv;
+	size_t argc = 0;
+	int pipefd[2], stderrfd;
+
+	j->failed = false;
+	j->build = build;
+	j->status = 0;
+	j->cost = 0;
+	j->cur = NULL;
+	j->buflen = j->blockstart = 0;
+	j->mark = j->start;
+
+	/* take other pending dependency generations of the builder along */
+	if (!j->batch && !(j->batch = calloc(batchsize, sizeof *j->batch))) {
+		perror("calloc");
+		exit(1);
+	}
+	j->nbatch = 0;
+	j->batch[j->nbatch++] = build;
+	for (size_t i = nwork; i-- > 0 && j->nbatch < batchsize;) {
+		struct build *b = work[i];
+		if (b->builder != build->builder || b->flags & (FLAG_DEPS|FLAG_SOLO))
+			continue;
+		workremove(i);
+		j->batch[j->nbatch++] = b;
+	}
+
+	if (!(argv = calloc(j->nbatch + 16, sizeof *argv))) {
+		perror("calloc");
+		exit(1);
+	}
+	argc = xbpssrcargs(argv, path, sizeof path, build->builder, NULL, NULL);
+	argv[argc++] = "dbulk-dump";
+	for (size_t i = 0; i < j->nbatch; i++)
+		argv[argc++] = j->batch[i]->pkgname->name;
+	argv[argc] = NULL;
+	cgroupargv(j, argv, cgpath, sizeof cgpath);
+
+	xsnprintf(errpath, sizeof errpath, "batch.%zu.err.tmp", (size_t)(j-jobs));
+	stderrfd = xopenat(build->builder->depfd, build->builder->depdir, errpath, O_WRONLY|O_CREAT|O_TRUNC);
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		exit(1);
+	}
+
+	if ((errno = posix_spawn_file_actions_init(&actions))) {
+		perror("posix_spawn_file_actions_init");
+		goto err1;
+	}
+	if ((errno = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0))) {
+		perror("posix_spawn_file_actions_addopen");
+		goto err2;
+	}
+	if ((errno = posix_spawn_file_actions_adddup2(&actions, pipefd[1], 1))) {
+		perror("posix_spawn_file_actions_adddup2");
+		goto err2;
+	}
+	if ((errno = posix_spawn_file_actions_adddup2(&actions, stderrfd, 2))) {
+		perror("posix_spawn_file_actions_adddup2");
+		goto err2;
+	}
+	if ((errno = posix_spawnp(&j->pid, argv[0], &actions, NULL, argv, environ))) {
+		fprintf(stderr, "posix_spawn: %s: %s\n", build->pkgname->name, strerror(errno));
+		goto err2;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipefd[1]);
+	close(stderrfd);
+	free(argv);
+
+	j->outfd = pipefd[0];
+	if (fcntl(j->outfd, F_SETFL, O_NONBLOCK) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+	evadd(j->outfd, EV_DUMP, j-jobs);
+	return 0;
+
+err2:
+	posix_spawn_file_actions_destroy(&actions);
+err1:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(stderrfd);
+	free(argv);
+	xunlinkat(build->builder->depfd, build->builder->depdir, errpath);
+	/* put the others back, only the first one failed to start */
+	for (size_t i = 1; i < j->nbatch; i++)
+		queue(j->batch[i]);
+	j->nbatch = 0;
+	return -1;
+}
+
+static void
+pkgnamedone(struct pkgname *pkgname, struct builder *builder, bool prune)
+{
+	pkgname->dirty = false;
+	for (size_t i = 0; i < pkgname->nuse; i++) {
+		struct build *build = pkgname->use[i].build;
+		/* skip edges released by builds for other builders */
+		if (pkgname->use[i].builder != builder)
+			continue;
+		/* skip edges not used in this build */
+		if (!(build->flags & FLAG_WORK))
+			continue;
+		/* up to date builds are never queued */
+		if ((build->flags & (FLAG_DIRTY|FLAG_SKIP)) != FLAG_DIRTY)
+			continue;
+		/* fetches are queued right away */
+		if (build->flags & FLAG_FETCH)
+			continue;
+		if (prune) {
+			buildpruned(build, pkgname);
+			continue;
+		}
+		if (--build->nblock == 0)
+			queue(build);
+	}
+}
+
+static void
+failure(void)
+{
+	if (++numfail == maxfail && !stopping) {
+		fprintf(stderr, "too many failures (%zu), stopping\n", numfail);
+		stopping = true;
+	}
+}
+
+/* a dependency failed, the build and everything using it is dropped */
+static void
+buildpruned(struct build *build, struct pkgname *cause)
+{
+	uint64_t cost = buildcost(build);
+
+	build->flags |= FLAG_SKIP;
+	numfinished++;
+	remaining -= cost < remaining ? cost : remaining;
+	fprintf(stderr, "[%zu/%zu eta %s] skipped %s, depends on failed %s\n", numfinished, numtotal, eta(), build->pkgname->name, cause->name);
+	eventskip(build, cause->name);
+	failure();
+	buildfailed(build);
+}
+
+/* none of the dependents of a failed build can be built in this run */
+static void
+buildfailed(struct build *build)
+{
+	build->flags |= FLAG_SKIP;
+	pkgnamedone(build->pkgname, build->builder, true);
+	for (size_t i = 0; i < build->nsubpkgs; i++)
+		pkgnamedone(build->subpkgs[i], build->builder, true);
+	replanusers(build);
+}
+
+static void
+builddone(struct job *j)
+{
+	char path1[PATH_MAX], path2[PATH_MAX];
+	struct build *build = j->build;
+	const char *name = build->pkgname->name;
+	const char *version = build->version;
+	const char *revision = build->revision;
+
+	xsnprintf(path1, sizeof path1, "%s-%s_%s.tmp", name, version, revision);
+	if (build->flags & FLAG_FETCH && build->cache == CACHE_PROBE && !j->failed &&
+	    WIFEXITED(j->status) && WEXITSTATUS(j->status) == 125) {
+		/* in none of the caches, build it once the dependencies are */
+		xunlinkat(build->builder->logfd, build->builder->logdir, path1);
+		build->flags &= ~FLAG_FETCH;
+		build->cache = CACHE_MISS;
+		numtotal++;
+		remaining += buildcost(build);
+		fetchdeps(build);
+		recount(build);
+		return;
+	}
+
+	if (WIFEXITED(j->status) && WEXITSTATUS(j->status) != 0) {
+		fprintf(stderr, "job failed: %s\n", name);
+		j->failed = true;
+	}
+
+	xsnprintf(path2, sizeof path2, "%s-%s_%s.%s", name, version, revision, j->failed ? "err" : "log");
+	xrenameat(build->builder->logfd, build->builder->logdir, path1, path2);
+
+	if (!j->failed) {
+		build->flags &= ~FLAG_DIRTY;
+		pkgnamedone(build->pkgname, build->builder, false);
+		for (size_t i = 0; i < build->nsubpkgs; i++) {
+			pkgnamedone(build->subpkgs[i], build->builder, false);
+		}
+	} else {
+		buildfailed(build);
+	}
+}
+
+static int
+buildstart(struct job *j, struct build *build)
+{
+	extern char **environ;
+	char path[PATH_MAX], xbpssrc[PATH_MAX];
+	char cgpath[PATH_MAX], stpath[PATH_MAX], remotecmd[2*PATH_MAX];
+	posix_spawn_file_actions_t actions;
+	char njobs[32], pkgver[PATH_MAX];
+	char **argv;
+	int argc, fd, outfd, pipefd[2] = {-1, -1};
+
+	xsnprintf(njobs, sizeof njobs, "%zu", j->ntokens);
+	/* lookups pass each cache url */
+	if (!(argv = calloc(ncacheurls + 32, sizeof *argv))) {
+		perror("calloc");
+		exit(1);
+	}
+
+	j->failed = false;
+	j->build = build;
+	j->status = 0;
+
+	xsnprintf(path, sizeof path, "%s-%s_%s.tmp", build->pkgname->name, build->version, build->revision);
+	fd = xopenat(build->builder->logfd, build->builder->logdir, path, O_WRONLY|O_CREAT|O_TRUNC);
+	outfd = fd;
+	if (logpipe) {
+		if (pipe2(pipefd, O_CLOEXEC) == -1) {
+			perror("pipe2");
+			exit(1);
+		}
+		outfd = pipefd[1];
+	}
+
+	if (build->flags & FLAG_FETCH && !build->cacheurl) {
+		/* look the package up in the remote caches first, exit status
+		 * 125 tells builddone it has to be built */
+		argc = 0;
+		argv[argc++] = "/bin/sh";
+		argv[argc++] = "-c";
+		argv[argc++] = "cd \"$1\" || exit; a=$2 n=$3; shift 3; "
+		    "for u; do for f in \"$n.$a.xbps\" \"$n.noarch.xbps\"; do "
+		    "curl -fsIL --max-time 30 -o /dev/null \"$u/$f\" || continue; "
+		    "curl -fsSL -o \"$f.part\" \"$u/$f\" && mv -f \"$f.part\" \"$f\" && XBPS_TARGET_ARCH=\"$a\" xbps-rindex -a \"$f\"; "
+		    "exit; done; done; exit 125";
+		argv[argc++] = "sh";
+		argv[argc++] = (char *)fetchdir;
+		argv[argc++] = build->builder->arch;
+		xsnprintf(pkgver, sizeof pkgver, "%s-%s_%s", build->pkgname->name, build->version, build->revision);
+		argv[argc++] = pkgver;
+		for (size_t i = 0; i < ncacheurls; i++)
+			argv[argc++] = (char *)cacheurls[i];
+		argv[argc] = NULL;
+	} else if (build->flags & FLAG_FETCH) {
+		/* download the package and add it to the local repository */
+		argc = 0;
+		argv[argc++] = "/bin/sh";
+		argv[argc++] = "-c";
+		argv[argc++] = "cd \"$1\" && curl -fsSL -o \"$3.part\" \"$2\" && mv -f \"$3.part\" \"$3\" && XBPS_TARGET_ARCH=\"$4\" xbps-rindex -a \"$3\"";
+		argv[argc++] = "sh";
+		argv[argc++] = (char *)fetchdir;
+		argv[argc++] = (char *)build->cacheurl;
+		argv[argc++] = (char *)build->cachefile;
+		argv[argc++] = build->builder->arch;
+		argv[argc] = NULL;
+	} else {
+		argc = xbpssrcargs(argv, xbpssrc, sizeof xbpssrc, build->builder, j->masterdir, j->exec);
+		argv[argc++] = "-1Et";
+		argv[argc++] = "-j";
+		argv[argc++] = njobs;
+		argv[argc++] = "pkg";
+		argv[argc++] = build->pkgname->name;
+		argv[argc] = NULL;
+		remoteargv(j->exec, argv, remotecmd, sizeof remotecmd);
+	}
+	journalargv(j, argv, stpath, sizeof stpath);
+	cgroupargv(j, argv, cgpath, sizeof cgpath);
+
+	if ((errno = posix_spawn_file_actions_init(&actions))) {
+		perror("posix_spawn_file_actions_init");
+		goto err1;
+	}
+	if ((errno = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0))) {
+		perror("posix_spawn_file_actions_addopen");
+		goto err2;
+	}
+	if ((errno = posix_spawn_file_actions_adddup2(&actions, outfd, 1))) {
+		perror("posix_spawn_file_actions_adddup2");
+		goto err2;
+	}
+	if ((errno = posix_spawn_file_actions_adddup2(&actions, outfd, 2))) {
+		perror("posix_spawn_file_actions_adddup2");
+		goto err2;
+	}
+	if ((errno = jobspawn(j, argv, &actions))) {
+		fprintf(stderr, "posix_spawn: %s: %s\n", build->pkgname->name, strerror(errno));
+		goto err2;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	free(argv);
+	if (logpipe) {
+		close(pipefd[1]);
+		logstart(j, fd, pipefd[0]);
+	} else {
+		close(fd);
+	}
+
+	return 0;
+
+err2:
+	posix_spawn_file_actions_destroy(&actions);
+err1:
+	free(argv);
+	close(fd);
+	if (logpipe) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+err0:
+	return -1;
+}
+
+/*
+ * Split the core budget between the jobs expected to run concurrently,
+ * a lone build gets the whole machine while a full pool of builds gets one
+ * or two cores each.  Cores held by running jobs are not handed out again.
+ */
+static size_t
+jobtokens(struct build *build)
+{
+	size_t expect, share, avail;
+
+	/* dependency generation and fetching are single threaded */
+	if ((build->flags & (FLAG_DEPS|FLAG_FETCH)) != FLAG_DEPS)
+		return 1;
+	expect = numlocal + 1 + nwork;
+	if (expect > maxjobs)
+		expect = maxjobs;
+	share = maxtokens / expect;
+	avail = maxtokens > numtokens ? maxtokens - numtokens : 0;
+	if (share > avail)
+		share = avail;
+	return share > 0 ? share : 1;
+}
+
+/*
+ * The journal records the jobs that were started and have finished, so a
+ * run that was killed finds the jobs it left behind.  Ready, done and
+ * failed builds need no record, the logs and dependency files tell.  Jobs
+ * run under a shell that writes their exit status next to their output, an
+ * orphaned job that finished while nobody waited still has its outcome
+ * recorded.  See journalload and journaladopt.
+ */
+static FILE *journalfp;
+
+struct orphan {
+	pid_t pid;
+	uint64_t pidstart;
+	char kind[8];
+	const char *builder, *pkgname, *version, *revision;
+	size_t ntokens;
+	const char *host, *masterdir, *cgroup;
+	/* the output went through our pipe, see logstart */
+	bool piped;
+	bool alive;
+};
+static struct orphan *orphans;
+static size_t norphans, orphanscap;
+
+/* start time of a process in clock ticks since boot, 0 if it is gone or a zombie */
+static uint64_t
+procstart(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	uint64_t start = 0;
+	ssize_t n;
+	int fd;
+
+	xsnprintf(path, sizeof path, "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return 0;
+	n = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	/* the command may contain spaces, fields continue after its ')' */
+	if (!(p = strrchr(buf, ')')) || p[1] != ' ' || p[2] == 'Z')
+		return 0;
+	for (int field = 2; field < 22 && p; field++)
+		p = strchr(p + 1, ' ');
+	if (p)
+		start = strtoull(p + 1, NULL, 10);
+	return start;
+}
+
+/* the job output and exit status files live next to each other */
+static void
+jobfile(const char *kind, const char *name, const char *version, const char *revision, const char *suffix, char *buf, size_t len)
+{
+	if (strcmp(kind, "deps") == 0)
+		xsnprintf(buf, len, "%s.%s", name, suffix);
+	else
+		xsnprintf(buf, len, "%s-%s_%s.%s", name, version, revision, suffix);
+}
+
+/* run the job under a shell that records its exit status in path */
+static void
+journalargv(struct job *j, char *argv[], char *path, size_t len)
+{
+	struct build *build = j->build;
+	struct builder *builder = build->builder;
+	size_t argc = 0;
+	char name[PATH_MAX];
+
+	if (!journalfp)
+		return;
+	while (argv[argc])
+		argc++;
+	memmove(argv+4, argv, (argc+1) * sizeof *argv);
+	jobfile(jobkind(j), build->pkgname->name, build->version, build->revision, "status", name, sizeof name);
+	xsnprintf(path, len, "%s/%s", build->flags & FLAG_DEPS ? builder->logdir : builder->depdir, name);
+	argv[0] = "/bin/sh";
+	argv[1] = "-c";
+	/* the signals sent to the group end the job, not the shell, which
+	 * then passes on how the job ended.  The job runs in the foreground,
+	 * background jobs would ignore SIGINT and SIGQUIT. */
+	argv[2] = "trap : INT TERM; \"$@\"; s=$?; echo $s >\"$0\"; "
+	    "[ $s -gt 128 ] || exit $s; trap - INT TERM; kill -$((s-128)) $$";
+	argv[3] = path;
+}
+
+/* journaled jobs get their own process group, killing the scheduler
+ * leaves them running to be adopted, see jobsignal */
+static int
+jobspawn(struct job *j, char *argv[], const posix_spawn_file_actions_t *actions)
+{
+	extern char **environ;
+	posix_spawnattr_t attr;
+	int err;
+
+	if (!journalfp)
+		return posix_spawnp(&j->pid, argv[0], actions, NULL, argv, environ);
+	if ((err = posix_spawnattr_init(&attr)))
+		return err;
+	if (!(err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP)))
+		err = posix_spawnp(&j->pid, argv[0], actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	return err;
+}
+
+static void
+journalwrite(const struct orphan *o)
+{
+	fprintf(journalfp, "start %d %" PRIu64 " %s %s %s %s %s %zu %s %s %s %s\n", (int)o->pid, o->pidstart, o->kind,
+	    o->builder, o->pkgname, o->version ? o->version : "-", o->revision ? o->revision : "-", o->ntokens,
+	    o->host ? o->host : "-", o->masterdir ? o->masterdir : "-", o->cgroup ? o->cgroup : "-",
+	    o->piped ? "pipe" : "file");
+	fflush(journalfp);
+}
+
+static void
+journalstart(struct job *j)
+{
+	struct build *build = j->build;
+	struct orphan o = {
+		.pid = j->pid,
+		.pidstart = procstart(j->pid),
+		.builder = buildername(build->builder),
+		.pkgname = build->pkgname->name,
+		.version = build->version,
+		.revision = build->revision,
+		.ntokens = j->ntokens,
+		.host = j->exec ? j->exec->host : NULL,
+		.masterdir = j->masterdir ? j->masterdir->path : NULL,
+		.cgroup = j->cgroupfd != -1 ? j->cgroup : NULL,
+		.piped = j->logring != NULL,
+	};
+
+	if (!journalfp)
+		return;
+	strlcpy(o.kind, jobkind(j), sizeof o.kind);
+	journalwrite(&o);
+}
+
+static void
+journalend(struct job *j)
+{
+	char name[PATH_MAX];
+	struct build *build = j->build;
+	struct builder *builder = build->builder;
+
+	if (!journalfp)
+		return;
+	jobfile(jobkind(j), build->pkgname->name, build->version, build->revision, "status", name, sizeof name);
+	if (build->flags & FLAG_DEPS)
+		xunlinkat(builder->logfd, builder->logdir, name);
+	else
+		xunlinkat(builder->depfd, builder->depdir, name);
+	fprintf(journalfp, "end %d\n", (int)j->pid);
+	fflush(journalfp);
+}
+
+/* exit status recorded by the job shell, as returned by wait */
+static int
+journalstatus(int dirfd, const char *name)
+{
+	char buf[32];
+	ssize_t n;
+	int fd, s;
+
+	if ((fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC)) == -1)
+		return -1;
+	n = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	s = atoi(buf);
+	return s > 128 ? s - 128 : s << 8;
+}
+
+static struct builder *
+builderbyname(const char *name)
+{
+	struct builder *builder, *tmp;
+
+	HASH_ITER(hh, builders, builder, tmp) {
+		if (strcmp(buildername(builder), name) == 0)
+			return builder;
+	}
+	return NULL;
+}
+
+/*
+ * Settle the jobs of a killed run before planning.  Jobs that finished get
+ * their output renamed like builddone and gendepdone would, the output of
+ * the ones that died with us is removed.  Jobs still running are adopted
+ * once the graph is planned.
+ */
+static void
+orphansettle(struct orphan *o)
+{
+	char tmp[PATH_MAX], status[PATH_MAX], out[PATH_MAX];
+	struct builder *builder = builderbyname(o->builder);
+	bool deps = strcmp(o->kind, "deps") == 0;
+	int dirfd, s;
+	const char *dir;
+
+	if (!builder)
+		return;
+	dirfd = deps ? builder->depfd : builder->logfd;
+	dir = deps ? builder->depdir : builder->logdir;
+	jobfile(o->kind, o->pkgname, o->version, o->revision, deps ? "dep.tmp" : "tmp", tmp, sizeof tmp);
+	jobfile(o->kind, o->pkgname, o->version, o->revision, "status", status, sizeof status);
+	s = journalstatus(dirfd, status);
+	if (s == -1 || WIFSIGNALED(s)) {
+		fprintf(stderr, "journal: %s@%s: job died with the previous run\n", o->pkgname, o->builder);
+		xunlinkat(dirfd, dir, tmp);
+		if (deps) {
+			jobfile(o->kind, o->pkgname, NULL, NULL, "err.tmp", tmp, sizeof tmp);
+			xunlinkat(dirfd, dir, tmp);
+		}
+	} else if (deps) {
+		char err[PATH_MAX], errtmp[PATH_MAX];
+		fprintf(stderr, "journal: %s@%s: dependency generation %s\n", o->pkgname, o->builder, s == 0 ? "finished" : "failed");
+		jobfile(o->kind, o->pkgname, NULL, NULL, "err.tmp", errtmp, sizeof errtmp);
+		jobfile(o->kind, o->pkgname, NULL, NULL, "err", err, sizeof err);
+		jobfile(o->kind, o->pkgname, NULL, NULL, "dep", out, sizeof out);
+		if (s == 0) {
+			xunlinkat(dirfd, dir, errtmp);
+			if (faccessat(dirfd, tmp, F_OK, 0) == 0)
+				xrenameat(dirfd, dir, tmp, out);
+		} else {
+			xunlinkat(dirfd, dir, tmp);
+			if (faccessat(dirfd, errtmp, F_OK, 0) == 0)
+				xrenameat(dirfd, dir, errtmp, err);
+		}
+	} else {
+		fprintf(stderr, "journal: %s@%s: %s %s\n", o->pkgname, o->builder, o->kind, s == 0 ? "finished" : "failed");
+		jobfile(o->kind, o->pkgname, o->version, o->revision, s == 0 ? "log" : "err", out, sizeof out);
+		if (faccessat(dirfd, tmp, F_OK, 0) == 0)
+			xrenameat(dirfd, dir, tmp, out);
+	}
+	xunlinkat(dirfd, dir, status);
+}
+
+static char *
+journalfield(char *s)
+{
+	return strcmp(s, "-") == 0 ? NULL : xstrdup(s);
+}
+
+static void
+journalload(const char *path)
+{
+	char line[PATH_MAX+512];
+	FILE *fp;
+	size_t nlines = 0;
+
+	if ((fp = fopen(path, "r"))) {
+		while (fgets(line, sizeof line, fp)) {
+			char kind[8], builder[128], pkgname[256], version[128], revision[32], host[256], masterdir[PATH_MAX], cgroup[32];
+			char output[8] = "file";
+			struct orphan o = {0};
+			int pid, n;
+			nlines++;
+			if (sscanf(line, "end %d", &pid) == 1) {
+				for (size_t i = 0; i < norphans;) {
+					if (orphans[i].pid == pid)
+						orphans[i] = orphans[--norphans];
+					else
+						i++;
+				}
+				continue;
+			}
+			/* older records have no output field */
+			n = sscanf(line, "start %d %" SCNu64 " %7s %127s %255s %127s %31s %zu %255s %4095s %31s %7s", &pid, &o.pidstart,
+			    kind, builder, pkgname, version, revision, &o.ntokens, host, masterdir, cgroup, output);
+			if (n != 11 && n != 12) {
+				fprintf(stderr, "warn: %s:%zu: malformed journal record\n", path, nlines);
+				continue;
+			}
+			o.pid = pid;
+			strlcpy(o.kind, kind, sizeof o.kind);
+			o.builder = xstrdup(builder);
+			o.pkgname = xstrdup(pkgname);
+			o.version = journalfield(version);
+			o.revision = journalfield(revision);
+			o.host = journalfield(host);
+			o.masterdir = journalfield(masterdir);
+			o.cgroup = journalfield(cgroup);
+			o.piped = strcmp(output, "pipe") == 0;
+			orphans = grow(orphans, norphans, &orphanscap, sizeof *orphans);
+			orphans[norphans++] = o;
+		}
+		fclose(fp);
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	/* start over with the jobs that are still running */
+	if (!(journalfp = fopen(path, "w"))) {
+		fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < norphans; i++) {
+		struct orphan *o = &orphans[i];
+		if (o->pidstart != 0 && procstart(o->pid) == o->pidstart) {
+			o->alive = true;
+			journalwrite(o);
+			orphans[n++] = *o;
+		} else {
+			orphansettle(o);
+		}
+	}
+	norphans = n;
+}
+
+/*
+ * Write the dependency databases every CHECKPOINT seconds, after a crash
+ * the next run plans from them instead of reading every dependency file.
+ * Returns the milliseconds until the next checkpoint or -1.
+ */
+enum { CHECKPOINT = 60 };
+static struct timespec nextcheckpoint;
+
+static int
+checkpoint(void)
+{
+	struct builder *builder, *tmp;
+	struct timespec now;
+	long ms;
+
+	if (!journalfp)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (nextcheckpoint.tv_sec == 0)
+		nextcheckpoint.tv_sec = now.tv_sec + CHECKPOINT;
+	ms = (nextcheckpoint.tv_sec - now.tv_sec) * 1000 - now.tv_nsec / 1000000;
+	if (ms <= 0) {
+		HASH_ITER(hh, builders, builder, tmp)
+			dbwrite(builder);
+		nextcheckpoint.tv_sec = now.tv_sec + CHECKPOINT;
+		ms = CHECKPOINT * 1000;
+	}
+	return ms;
+}
+
+static int
+jobstart(struct job *j, struct build *build)
+{
+	int rv;
+
+	clock_gettime(CLOCK_MONOTONIC, &j->start);
+	j->deadline = j->start;
+	j->deadline.tv_sec += maxtime;
+	j->timedout = 0;
+	j->adopted = false;
+	j->cost = buildcost(build);
+	j->masterdir = NULL;
+	if (cgroupstart(j) == -1)
+		return -1;
+	if (j->exec)
+		j->ntokens = j->exec->cores / j->exec->slots > 0 ? j->exec->cores / j->exec->slots : 1;
+	else
+		j->ntokens = jobtokens(build);
+	if (build->flags & FLAG_DEPS) {
+		if (!j->exec && !(build->flags & FLAG_FETCH))
+			j->masterdir = masterdirlease(build);
+		rv = buildstart(j, build);
+	} else if (batchsize > 1 && !(build->flags & FLAG_SOLO)) {
+		rv = gendepbatchstart(j, build);
+	} else {
+		rv = gendepstart(j, build);
+	}
+	if (rv == 0) {
+		if (j->exec)
+			j->exec->used++;
+		else
+			numtokens += j->ntokens, numlocal++;
+		if (j->nbatch == 0)
+			journalstart(j);
+		eventjob("start", j, jobkind(j));
+	} else {
+		if (j->masterdir) {
+			j->masterdir->build = NULL;
+			j->masterdir = NULL;
+		}
+		cgroupdone(j, NULL);
+	}
+	return rv;
+}
+
+/* throw away the output of a job we interrupted, it didn't fail on its own */
+static void
+jobabort(struct job *j)
+{
+	char path[PATH_MAX];
+	struct build *build = j->build;
+
+	fprintf(stderr, "job interrupted: %s\n", build->pkgname->name);
+	if (j->nbatch > 0) {
+		if (j->outfd != -1) {
+			close(j->outfd);
+			j->outfd = -1;
+		}
+		xsnprintf(path, sizeof path, "batch.%zu.err.tmp", (size_t)(j-jobs));
+		xunlinkat(build->builder->depfd, build->builder->depdir, path);
+		j->nbatch = 0;
+	} else if (build->flags & FLAG_DEPS) {
+		xsnprintf(path, sizeof path, "%s-%s_%s.tmp", build->pkgname->name, build->version, build->revision);
+		xunlinkat(build->builder->logfd, build->builder->logdir, path);
+	} else {
+		xsnprintf(path, sizeof path, "%s.dep.tmp", build->pkgname->name);
+		xunlinkat(build->builder->depfd, build->builder->depdir, path);
+		xsnprintf(path, sizeof path, "%s.err.tmp", build->pkgname->name);
+		xunlinkat(build->builder->depfd, build->builder->depdir, path);
+	}
+}
+
+static void
+jobdone(struct job *j)
+{
+	struct timespec now;
+	struct hist h;
+
+	if (j->logring)
+		logfinish(j);
+	if (j->nbatch == 0)
+		journalend(j);
+	if (j->exec)
+		j->exec->used--;
+	else
+		numtokens -= j->ntokens, numlocal--;
+	if (j->masterdir) {
+		masterdirrelease(j->masterdir);
+		j->masterdir = NULL;
+	}
+
+	if (j->timedout)
+		j->failed = true;
+
+	if (stopping && WIFSIGNALED(j->status)) {
+		cgroupdone(j, NULL);
+		jobabort(j);
+		return;
+	}
+
+	if (j->nbatch > 0) {
+		cgroupdone(j, NULL);
+		/* progress and history are per package of the batch */
+		if (WIFSIGNALED(j->status)) {
+			fprintf(stderr, "job terminated due to signal %d: %s\n", WTERMSIG(j->status), j->build->pkgname->name);
+			j->failed = true;
+		}
+		gendepbatchdone(j);
+		return;
+	}
+
+	numfinished++;
+	remaining -= j->cost < remaining ? j->cost : remaining;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	h.duration = (now.tv_sec - j->start.tv_sec) * 1000 + (now.tv_nsec - j->start.tv_nsec) / 1000000;
+	if (h.duration == 0)
+		h.duration = 1;
+	h.maxrss = j->rusage.ru_maxrss;
+	h.status = j->status;
+	h.cputime = (j->rusage.ru_utime.tv_sec + j->rusage.ru_stime.tv_sec) * 1000 +
+	    (j->rusage.ru_utime.tv_usec + j->rusage.ru_stime.tv_usec) / 1000;
+	/* 512 byte blocks */
+	h.io = (j->rusage.ru_inblock + j->rusage.ru_oublock) / 2;
+	h.cores = j->ntokens;
+	/* the cgroup accounts for the whole process tree */
+	cgroupdone(j, &h);
+	/* fetch times say nothing about build times, adopted jobs started earlier */
+	if (!(j->build->flags & FLAG_FETCH) && !j->adopted)
+		histrecord(j->build, j->build->flags & FLAG_DEPS ? HIST_BUILD : HIST_DEPS, &h);
+
+	if (WIFEXITED(j->status)) {
+		; /* exit status is handled by builddone and gendepdone */
+	} else if (WIFSIGNALED(j->status)) {
+		fprintf(stderr, "job terminated due to signal %d: %s\n", WTERMSIG(j->status), j->build->pkgname->name);
+		j->failed = true;
+	} else {
+		/* cannot happen according to POSIX */
+		fprintf(stderr, "job status unknown: %s\n", j->build->pkgname->name);
+		j->failed = true;
+	}
+	if (j->build->flags & FLAG_DEPS) {
+		builddone(j);
+	} else {
+		gendepdone(j);
+	}
+}
+
+static struct build *
+mkbuild(struct pkgname *pkgname, struct builder *builder)
+{
+	struct build *build;
+	pthread_mutex_lock(&graphlock);
+	build = arenaalloc(sizeof *build);
+	build->builder = builder;
+	build->pkgname = pkgname;
+	build->allnext = builds;
+	build->depmtime = MTIME_UNKNOWN;
+	build->deperrmtime = MTIME_UNKNOWN;
+	build->logmtime = MTIME_UNKNOWN;
+	build->logerrmtime = MTIME_UNKNOWN;
+	build->hist = histfind(buildername(builder), pkgname->name);
+	builds = build;
+	pkgnamebuild(pkgname, build);
+	pthread_mutex_unlock(&graphlock);
+	return build;
+}
+
+
+/*
+ * The graph is walked depth first with an explicit stack, builds on the
+ * stack carry FLAG_CYCLE.  Each frame iterates over the hostdeps and then
+ * the targetdeps of its build.
+ */
+struct frame {
+	struct build *build;
+	size_t i;
+};
+static _Thread_local struct frame *stack;
+static _Thread_local size_t stacklen, stackcap;
+
+/*
+ * While the builders are resolved in parallel, hostdeps of cross builds are
+ * not walked by the thread of the target builder.  They are collected here,
+ * counted as blocking and resolved once all threads are done.
+ */
+struct defer {
+	struct build *build;
+	struct pkgname *dep;
+};
+static bool resolving;
+static struct defer *deferred;
+static size_t ndeferred, deferredcap;
+
+static void
+cycle(struct build *build)
+{
+	size_t k = stacklen;
+
+	while (k > 0 && stack[k-1].build != build)
+		k--;
+	if (k == 0)
+		return;
+	flockfile(stderr);
+	fprintf(stderr, "dependency cycle:");
+	for (size_t i = k-1; i < stacklen; i++) {
+		struct build *b = stack[i].build;
+		fprintf(stderr, " %s@%s ->", b->pkgname->name, buildername(b->builder));
+		b->flags |= FLAG_SKIP|FLAG_DIRTY;
+	}
+	fprintf(stderr, " %s@%s\n", build->pkgname->name, buildername(build->builder));
+	funlockfile(stderr);
+}
+
+static void
+fetchqueue(struct build *build)
+{
+	pthread_mutex_lock(&graphlock);
+	build->flags |= FLAG_DIRTY;
+	numtotal++;
+	remaining += buildcost(build);
+	queue(build);
+	pthread_mutex_unlock(&graphlock);
+}
+
+/* whether a dirty build is waiting for the cached package of build */
+static bool
+fetchwanted(struct build *build)
+{
+	for (size_t i = 0; i <= build->nsubpkgs; i++) {
+		struct pkgname *pkgname = i == 0 ? build->pkgname : build->subpkgs[i-1];
+		for (size_t k = 0; k < pkgname->nuse; k++) {
+			struct build *user = pkgname->use[k].build;
+			if (pkgname->use[k].builder == build->builder && user->flags & FLAG_WORK &&
+			    (user->flags & (FLAG_DIRTY|FLAG_SKIP)) == FLAG_DIRTY)
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether the edge to pkgname for builder blocks a dirty build, binary
+ * packages from remote caches are queued for fetching on the way.
+ */
+static bool
+fetchdep(struct pkgname *pkgname, struct builder *builder)
+{
+	struct pkgname *srcpkg = pkgname->srcpkg ? pkgname->srcpkg : pkgname;
+	struct build *build = NULL;
+
+	pthread_mutex_lock(&graphlock);
+	for (size_t i = 0; i < srcpkg->nbuilds; i++) {
+		if (srcpkg->builds[i]->builder == builder) {
+			build = srcpkg->builds[i];
+			break;
+		}
+	}
+	if (build && (build->flags & (FLAG_FETCH|FLAG_DIRTY)) == FLAG_FETCH)
+		fetchqueue(build);
+	pthread_mutex_unlock(&graphlock);
+	return !build || build->flags & FLAG_DIRTY;
+}
+
+/*
+ * Fetch the cached dependencies of a dirty build.  Dependencies that were
+ * clean when they were walked may be queued for fetching now, so the
+ * blocking edges are counted again.
+ */
+static void
+fetchdeps(struct build *build)
+{
+	struct builder *hostbuilder = build->builder->host ? build->builder->host : build->builder;
+	size_t nblock = build->ndefer;
+
+	for (size_t i = 0; i < build->nhostdeps; i++) {
+		/* deferred edges are handled by resolve */
+		if (resolving && hostbuilder != build->builder)
+			break;
+		nblock += fetchdep(build->hostdeps[i], hostbuilder);
+	}
+	for (size_t i = 0; i < build->ntargetdeps; i++)
+		nblock += fetchdep(build->targetdeps[i], build->builder);
+	build->nblock = nblock;
+}
+
+static void
+buildleave(struct build *build)
+{
+	build->flags &= ~FLAG_CYCLE;
+	if (ncacheurls > 0 && (build->flags & (FLAG_DIRTY|FLAG_SKIP|FLAG_DEPS|FLAG_FETCH)) == (FLAG_DIRTY|FLAG_DEPS))
+		fetchdeps(build);
+	/* fetches do not wait for the dependencies */
+	if (build->flags & FLAG_FETCH)
+		build->nblock = 0;
+	pthread_mutex_lock(&graphlock);
+	if (build->flags & FLAG_DIRTY) {
+		/* Missing deps or missing package, mark all packages as dirty */
+		build->pkgname->dirty = true;
+		for (size_t i = 0; i < build->nsubpkgs; i++) {
+			struct pkgname *n1 = build->subpkgs[i];
+			n1->dirty = true;
+		}
+
+		if (!(build->flags & FLAG_SKIP)) {
+			if (build->nblock == 0)
+				queue(build);
+			numtotal++;
+			remaining += buildcost(build);
+		}
+	}
+	pthread_mutex_unlock(&graphlock);
+}
+
+/*
+ * Decide whether a build is dirty.  Returns the build if its dependencies
+ * still have to be walked, otherwise NULL with its final flags in *flagsp.
+ */
+static struct build *
+buildenter(struct pkgname *pkgname, struct builder *builder, int *flagsp)
+{
+	struct build *build = NULL;
+
+	pthread_mutex_lock(&graphlock);
+	if (pkgname->mtime == MTIME_UNKNOWN) {
+		pkgnamestat(pkgname);
+		if (pkgname->mtime == MTIME_MISSING) {
+			pthread_mutex_unlock(&graphlock);
+			if (explain)
+				fprintf(stderr, "explain: %s: skipping, no template to build package\n", pkgname->name);
+			*flagsp = FLAG_SKIP|FLAG_DIRTY;
+			return NULL;
+		}
+	}
+
+	struct pkgname *srcpkg = pkgname->srcpkg ? pkgname->srcpkg : pkgname;
+	for (size_t i = 0; i < srcpkg->nbuilds; i++) {
+		if (srcpkg->builds[i]->builder == builder) {
+			build = srcpkg->builds[i];
+			break;
+		}
+	}
+	if (!build)
+		build = mkbuild(srcpkg, builder);
+	pthread_mutex_unlock(&graphlock);
+
+	if (build->flags & FLAG_CYCLE) {
+		cycle(build);
+		*flagsp = build->flags;
+		return NULL;
+	}
+	if (build->flags & FLAG_WORK) {
+		*flagsp = build->flags;
+		return NULL;
+	}
+
+	build->flags |= FLAG_CYCLE|FLAG_WORK;
+	build->flags &= ~FLAG_DIRTY;
+
+	if (build->depmtime == MTIME_UNKNOWN)
+		depstat(build);
+
+	/* dep file missing or outdated */
+	if (build->depmtime < build->pkgname->mtime) {
+		/* depfile error missing or older than template, regenerate it */
+		if (build->deperrmtime < build->pkgname->mtime) {
+			/* XXX: order is irrelevant, but would ordering still make sense
+			 * to prioritize building packages over generating deps in
+			 * case we have an old dep file? */
+			if (explain)
+				fprintf(stderr, "explain %s@%s: dependency file %s\n", build->pkgname->name, build->builder->arch,
 				    build->depmtime == MTIME_MISSING ? "missing" : "older than template");
 			build->flags |= FLAG_DIRTY;
-			build->nblock = 0;
-			goto out;
+			build->nblock = 0;
+		} else {
+			build->flags |= FLAG_SKIP|FLAG_DIRTY;
+			if (explain)
+				fprintf(stderr, "explain %s@%s: skipping, template unchanged since previous error\n", build->pkgname->name, build->builder->arch);
+		}
+		goto out;
+	}
+
+	loaddeps(build);
+	if (!(build->flags & FLAG_DEPS))
+		goto out;
+	if (build->logmtime == MTIME_UNKNOWN)
+		logstat(build);
+	if (simulating)
+		build->logmtime = build->logerrmtime = MTIME_MISSING;
+	if (build->logmtime == MTIME_MISSING) {
+		if (build->logerrmtime == MTIME_MISSING && cachecheck(build) == CACHE_LOCAL) {
+			if (explain)
+				fprintf(stderr, "explain %s@%s: binary package in local cache\n", build->pkgname->name, build->builder->arch);
+		} else if (build->logerrmtime == MTIME_MISSING && build->cache == CACHE_REMOTE) {
+			/* up to date until a dirty build needs it, see fetchdeps */
+			if (explain)
+				fprintf(stderr, "explain %s@%s: binary package in remote cache\n", build->pkgname->name, build->builder->arch);
+			build->flags |= FLAG_FETCH;
+		} else if (build->logerrmtime == MTIME_MISSING && build->cache == CACHE_PROBE) {
+			/* dependents wait for the lookup, see builddone */
+			if (explain)
+				fprintf(stderr, "explain %s@%s: looking up binary package in remote caches\n", build->pkgname->name, build->builder->arch);
+			build->flags |= FLAG_FETCH|FLAG_DIRTY;
+		} else if (build->logerrmtime == MTIME_MISSING) {
+			/* Build the package if log and error mtime are missing */
+			if (explain)
+				fprintf(stderr, "explain %s@%s: missing\n", build->pkgname->name, build->builder->arch);
+			build->flags |= FLAG_DIRTY;
+		} else if (build->logerrmtime < build->pkgname->mtime) {
+			/* Build the package if log mtime is missing and error mtime is older than the template */
+			if (explain)
+				fprintf(stderr, "explain %s@%s: reattempt, template changed since previous error\n", build->pkgname->name, build->builder->arch);
+			build->flags |= FLAG_DIRTY;
 		} else {
 			build->flags |= FLAG_SKIP|FLAG_DIRTY;
 			if (explain)
@@ -872,189 +4481,1862 @@ _buildadd(struct pkgname *pkgname, struct builder *builder)
 			goto out;
 		}
 	}
+	build->nblock = 0;
+	return build;
+
+out:
+	buildleave(build);
+	*flagsp = build->flags;
+	return NULL;
+}
+
+static void
+buildpush(struct build *build)
+{
+	if (stacklen == stackcap) {
+		stackcap = stackcap ? stackcap * 2 : 64;
+		if (!(stack = reallocarray(stack, stackcap, sizeof *stack))) {
+			perror("reallocarray");
+			exit(1);
+		}
+	}
+	stack[stacklen].build = build;
+	stack[stacklen].i = 0;
+	stacklen++;
+}
+
+/* a dependency of build was walked, dirty ones block it */
+static void
+builddep(struct build *build, struct pkgname *dep, int flags)
+{
+	if (!(flags & FLAG_DIRTY))
+		return;
+	build->nblock++;
+	/* a skipped dependency will not be built in this run */
+	if (flags & FLAG_SKIP && (build->flags & (FLAG_DIRTY|FLAG_SKIP)) == FLAG_DIRTY) {
+		build->flags |= FLAG_SKIP;
+		if (explain)
+			fprintf(stderr, "explain %s@%s: skipping, dependency %s is skipped\n", build->pkgname->name, build->builder->arch, dep->name);
+	}
+}
+
+static int
+buildadd(struct pkgname *pkgname, struct builder *builder)
+{
+	struct build *build;
+	int flags;
+
+	if (!(build = buildenter(pkgname, builder, &flags)))
+		return flags;
+	buildpush(build);
+	while (stacklen > 0) {
+		struct frame *f = &stack[stacklen-1];
+		struct build *parent = f->build;
+		struct pkgname *dep;
+		struct builder *depbuilder;
+
+		if (f->i < parent->nhostdeps) {
+			dep = parent->hostdeps[f->i++];
+			depbuilder = parent->builder->host ? parent->builder->host : parent->builder;
+			if (resolving && depbuilder != parent->builder) {
+				pthread_mutex_lock(&graphlock);
+				if (ndeferred == deferredcap) {
+					deferredcap = deferredcap ? deferredcap * 2 : 1024;
+					if (!(deferred = reallocarray(deferred, deferredcap, sizeof *deferred))) {
+						perror("reallocarray");
+						exit(1);
+					}
+				}
+				deferred[ndeferred++] = (struct defer){ parent, dep };
+				pthread_mutex_unlock(&graphlock);
+				parent->nblock++;
+				parent->ndefer++;
+				continue;
+			}
+		} else if (f->i < parent->nhostdeps + parent->ntargetdeps) {
+			dep = parent->targetdeps[f->i++ - parent->nhostdeps];
+			depbuilder = parent->builder;
+		} else {
+			buildleave(parent);
+			flags = parent->flags;
+			if (--stacklen > 0)
+				builddep(stack[stacklen-1].build, parent->pkgname, flags);
+			continue;
+		}
+		if ((build = buildenter(dep, depbuilder, &flags))) {
+			buildpush(build);
+			continue;
+		}
+		builddep(parent, dep, flags);
+	}
+	return flags;
+}
+
+struct resolve {
+	struct builder *builder;
+	struct pkgname **roots;
+	size_t nroots;
+};
+
+static void *
+resolveworker(void *arg)
+{
+	struct resolve *r = arg;
+
+	for (size_t i = 0; i < r->nroots; i++)
+		buildadd(r->roots[i], r->builder);
+	free(stack);
+	stack = NULL;
+	stackcap = 0;
+	return NULL;
+}
+
+/*
+ * Walk the graph of every builder from roots, each builder on its own
+ * thread, then add the deferred edges from cross builds to their host.
+ */
+static void
+resolve(struct pkgname **roots, size_t nroots)
+{
+	size_t nbuilders = HASH_COUNT(builders), i = 0;
+	struct builder *builder, *tmp;
+	struct resolve *r;
+	pthread_t *threads;
+
+	r = xzmalloc(nbuilders * sizeof *r);
+	threads = xzmalloc(nbuilders * sizeof *threads);
+	HASH_ITER(hh, builders, builder, tmp) {
+		buildername(builder);
+		r[i++] = (struct resolve){ builder, roots, nroots };
+	}
+
+	resolving = nbuilders > 1;
+	for (i = 1; i < nbuilders; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, resolveworker, &r[i]))) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (nbuilders > 0)
+		resolveworker(&r[0]);
+	for (i = 1; i < nbuilders; i++)
+		pthread_join(threads[i], NULL);
+	resolving = false;
+
+	for (i = 0; i < ndeferred; i++) {
+		struct build *build = deferred[i].build;
+		int flags = buildadd(deferred[i].dep, build->builder->host);
+		build->ndefer--;
+		if (ncacheurls > 0 && (build->flags & (FLAG_DIRTY|FLAG_SKIP)) == FLAG_DIRTY)
+			flags = fetchdep(deferred[i].dep, build->builder->host) ? FLAG_DIRTY : 0;
+		if ((flags & (FLAG_DIRTY|FLAG_SKIP)) == (FLAG_DIRTY|FLAG_SKIP) &&
+		    (build->flags & (FLAG_DIRTY|FLAG_SKIP)) == FLAG_DIRTY)
+			buildpruned(build, deferred[i].dep);
+		if (flags & FLAG_DIRTY)
+			continue;
+		if (--build->nblock == 0 && (build->flags & (FLAG_DIRTY|FLAG_SKIP)) == FLAG_DIRTY)
+			queue(build);
+	}
+	free(deferred);
+	deferred = NULL;
+	ndeferred = deferredcap = 0;
+	free(r);
+	free(threads);
+}
+
+/* kilobytes of memory available to new jobs or -1 if unknown */
+static long
+memavailable(void)
+{
+	char line[256];
+	long kb = -1;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/meminfo", "r")))
+		return -1;
+	while (fgets(line, sizeof line, fp)) {
+		if (sscanf(line, "MemAvailable: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+	return kb;
+}
+
+/* share of time in percent some tasks stalled on memory or -1 if unknown */
+static double
+mempressure(void)
+{
+	double avg10;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/pressure/memory", "r")))
+		return -1;
+	if (fscanf(fp, "some avg10=%lf", &avg10) != 1)
+		avg10 = -1;
+	fclose(fp);
+	return avg10;
+}
+
+/*
+ * Decide if the next job can start next to the running ones.  Jobs are held
+ * back while the load average is above -l, while tasks are stalling on
+ * memory or if the available memory would not fit the peak RSS the package
+ * had the last time it was built.  Jobs started within the last minute
+ * probably haven't reached their own peak yet, their estimate is reserved.
+ */
+static bool
+admit(struct build *build)
+{
+	struct timespec now;
+	double load;
+	long avail, need = 0;
+
+	/* never stall the pool */
+	if (numlocal == 0)
+		return true;
+
+	if (maxload > 0 && getloadavg(&load, 1) == 1 && load >= maxload) {
+		if (explain)
+			fprintf(stderr, "explain %s@%s: holding back, load average %.2f\n", build->pkgname->name, build->builder->arch, load);
+		return false;
+	}
+
+	if (!(build->flags & FLAG_DEPS))
+		return true;
+
+	if (mempressure() > MAXPRESSURE) {
+		if (explain)
+			fprintf(stderr, "explain %s@%s: holding back, memory pressure\n", build->pkgname->name, build->builder->arch);
+		return false;
+	}
+
+	if (build->hist)
+		need = build->hist->ok[HIST_BUILD].maxrss;
+	if (need == 0 || (avail = memavailable()) == -1)
+		return true;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (size_t i = 0; i < numslots; i++) {
+		struct job *j = &jobs[i];
+		if (j->pid <= 0 || j->exec || !(j->build->flags & FLAG_DEPS) || !j->build->hist)
+			continue;
+		if (now.tv_sec - j->start.tv_sec < 60)
+			need += j->build->hist->ok[HIST_BUILD].maxrss;
+	}
+	if (need > avail) {
+		if (explain)
+			fprintf(stderr, "explain %s@%s: holding back, needs %ldkB of %ldkB available memory\n", build->pkgname->name, build->builder->arch, need, avail);
+		return false;
+	}
+	return true;
+}
+
+/* rough time left if all job slots stay busy */
+static const char *
+eta(void)
+{
+	static char buf[32];
+	uint64_t secs = remaining / numslots / 1000;
+
+	if (secs >= 3600)
+		xsnprintf(buf, sizeof buf, "%" PRIu64 "h%02" PRIu64 "m", secs / 3600, secs / 60 % 60);
+	else
+		xsnprintf(buf, sizeof buf, "%" PRIu64 "m%02" PRIu64 "s", secs / 60, secs % 60);
+	return buf;
+}
+
+static void
+sighandler(int sig)
+{
+	int saved = errno;
+	unsigned char c = sig;
+	(void)write(sigpipe[1], &c, 1);
+	errno = saved;
+}
+
+static int
+xpidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void
+evinit(void)
+{
+	struct sigaction sa = {
+		.sa_handler = sighandler,
+		.sa_flags = SA_RESTART,
+	};
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	if (pipe2(sigpipe, O_CLOEXEC|O_NONBLOCK) == -1) {
+		perror("pipe2");
+		exit(1);
+	}
+	evadd(sigpipe[0], EV_SIGNAL, 0);
+	clock_gettime(CLOCK_MONOTONIC, &runstart);
+	if (metricsaddr)
+		metricsinit();
+
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* without pidfds, fall back to reaping children on SIGCHLD */
+	int fd = xpidfd_open(getpid());
+	if (fd == -1) {
+		usepidfd = false;
+		sigaction(SIGCHLD, &sa, NULL);
+	} else {
+		close(fd);
+	}
+}
+
+static void
+jobwatch(size_t i)
+{
+	struct job *j = &jobs[i];
+
+	j->pidfd = -1;
+	if (!usepidfd)
+		return;
+	if ((j->pidfd = xpidfd_open(j->pid)) == -1) {
+		perror("pidfd_open");
+		exit(1);
+	}
+	evadd(j->pidfd, EV_PIDFD, i);
+}
+
+static void
+status(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "status: %zu running, %zu ready, %zu/%zu finished\n", numjobs, nwork, numfinished, numtotal);
+	for (size_t i = 0; i < numslots; i++) {
+		struct job *j = &jobs[i];
+		if (j->pid <= 0)
+			continue;
+		fprintf(stderr, "status: %s %s@%s %lds%s%s\n", jobkind(j),
+		    j->build->pkgname->name, buildername(j->build->builder), (long)(now.tv_sec - j->start.tv_sec),
+		    j->exec ? " on " : "", j->exec ? j->exec->host : "");
+	}
+}
+
+static void
+jobreap(size_t i, int status, struct rusage *rusage)
+{
+	struct job *j = &jobs[i];
+	const char *action = j->build->cache == CACHE_PROBE ? "looked up package" :
+	    j->build->flags & FLAG_FETCH ? "fetched package" :
+	    j->build->flags & FLAG_DEPS ? "build package" : "generated dependencies for";
+	bool batch = j->nbatch > 0;
+	/* jobdone moves the build on to its next kind of job */
+	const char *kind = jobkind(j);
+
+	if (j->pidfd != -1) {
+		close(j->pidfd);
+		j->pidfd = -1;
+	}
+	j->status = status;
+	j->rusage = *rusage;
+	jobdone(j);
+	eventjob("finish", j, kind);
+	numjobs--;
+	j->next = freejob;
+	j->pid = -1;
+	freejob = i;
+	if (!batch && j->failed)
+		failure();
+	eventstatus();
+	if (batch)
+		return;
+	fprintf(stderr, "[%zu/%zu eta %s] %s %s\n", numfinished, numtotal, eta(), action, j->build->pkgname->name);
+}
+
+static void
+sigevent(void)
+{
+	unsigned char sigs[64];
+	ssize_t n;
+
+	while ((n = read(sigpipe[0], sigs, sizeof sigs)) > 0) {
+		for (ssize_t k = 0; k < n; k++) {
+			switch (sigs[k]) {
+			case SIGINT:
+			case SIGTERM:
+				if (!stopping)
+					fprintf(stderr, "interrupted, waiting for %zu running jobs\n", numjobs);
+				stopping = true;
+				for (size_t i = 0; i < numslots; i++) {
+					if (jobs[i].pid > 0)
+						jobsignal(jobs[i].pid, sigs[k]);
+				}
+				break;
+			case SIGUSR1:
+				status();
+				break;
+			case SIGCHLD:
+				/* fallback without pidfds, reap whatever exited */
+				for (;;) {
+					int status;
+					struct rusage rusage;
+					pid_t pid = wait4(-1, &status, WNOHANG, &rusage);
+					if (pid == 0 || (pid == -1 && errno == ECHILD))
+						break;
+					if (pid == -1) {
+						perror("wait4");
+						exit(1);
+					}
+					for (size_t i = 0; i < numslots; i++) {
+						if (jobs[i].pid == pid && jobs[i].pidfd == -1) {
+							jobreap(i, status, &rusage);
+							break;
+						}
+					}
+				}
+				break;
+			}
+		}
+	}
+	if (n == -1 && errno != EAGAIN) {
+		perror("read");
+		exit(1);
+	}
+}
+
+static bool
+pending(struct build *build)
+{
+	return (build->flags & (FLAG_WORK|FLAG_DIRTY|FLAG_SKIP)) == (FLAG_WORK|FLAG_DIRTY);
+}
+
+/* a pending build among the dependencies of build */
+static struct build *
+pendingdep(struct build *build)
+{
+	struct builder *host = build->builder->host ? build->builder->host : build->builder;
+
+	for (size_t i = 0; i < build->nhostdeps + build->ntargetdeps; i++) {
+		bool hostdep = i < build->nhostdeps;
+		struct pkgname *dep = hostdep ? build->hostdeps[i] : build->targetdeps[i - build->nhostdeps];
+		struct builder *builder = hostdep ? host : build->builder;
+		struct pkgname *srcpkg = dep->srcpkg ? dep->srcpkg : dep;
+		for (size_t k = 0; k < srcpkg->nbuilds; k++) {
+			struct build *b = srcpkg->builds[k];
+			if (b->builder == builder && pending(b))
+				return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Dependencies that are regenerated while running can close a cycle that
+ * no single walk saw.  Once nothing runs anymore, the builds that are left
+ * wait on each other; report and drop the cycles.
+ */
+static void
+deadlock(void)
+{
+	struct build **members = NULL;
+	size_t nmembers = 0, cap = 0;
+
+	for (struct build *b = builds; b; b = b->allnext) {
+		struct build *p, *q;
+		if (!pending(b))
+			continue;
+		for (p = b; p && !(p->flags & FLAG_CYCLE); p = pendingdep(p))
+			p->flags |= FLAG_CYCLE;
+		for (q = b; q && q->flags & FLAG_CYCLE; q = pendingdep(q))
+			q->flags &= ~FLAG_CYCLE;
+		if (!p)
+			continue;
+		nmembers = 0;
+		q = p;
+		do {
+			members = grow(members, nmembers, &cap, sizeof *members);
+			members[nmembers++] = q;
+		} while ((q = pendingdep(q)) != p);
+		fprintf(stderr, "dependency cycle:");
+		for (size_t i = 0; i < nmembers; i++) {
+			fprintf(stderr, " %s@%s ->", members[i]->pkgname->name, buildername(members[i]->builder));
+			members[i]->flags |= FLAG_SKIP;
+		}
+		fprintf(stderr, " %s@%s\n", p->pkgname->name, buildername(p->builder));
+		for (size_t i = 0; i < nmembers; i++) {
+			uint64_t cost = buildcost(members[i]);
+			numfinished++;
+			remaining -= cost < remaining ? cost : remaining;
+			failure();
+			eventskip(members[i], "cycle");
+		}
+		for (size_t i = 0; i < nmembers; i++)
+			buildfailed(members[i]);
+	}
+	free(members);
+}
+
+/*
+ * -t simulate: replay the planned builds in virtual time.  Jobs take their
+ * recorded duration, scaled from the cores they had to the cores they get
+ * with Amdahl's law and a serial fraction of SIMSERIAL percent.  Core
+ * utilization counts the single core equivalent of the work.  Dependency
+ * generation is assumed to find no new dependencies, the build is ready as
+ * soon as it finished.  The plan is replayed once with the critical path
+ * priorities and once without to show what they are worth.
+ */
+enum { SIMSERIAL = 20 };
+
+struct simjob {
+	struct build *build;
+	struct executor *exec;
+	struct masterdir *masterdir;
+	size_t ntokens;
+	uint64_t start, end;
+};
+
+static uint64_t
+simcost(struct build *build, size_t ntokens)
+{
+	int kind = build->flags & FLAG_DEPS ? HIST_BUILD : HIST_DEPS;
+	uint64_t cost = buildcost(build);
+	double s = SIMSERIAL / 100.0;
+	size_t cores;
+
+	if (!build->hist || !build->hist->ok[kind].duration || (cores = build->hist->ok[kind].cores) == 0)
+		return cost;
+	return cost * (s + (1 - s) / ntokens) / (s + (1 - s) / cores);
+}
+
+static const char *
+simduration(char *buf, size_t len, uint64_t ms)
+{
+	uint64_t secs = ms / 1000;
+
+	if (secs >= 3600)
+		xsnprintf(buf, len, "%" PRIu64 "h%02" PRIu64 "m", secs / 3600, secs / 60 % 60);
+	else
+		xsnprintf(buf, len, "%" PRIu64 "m%02" PRIu64 "s", secs / 60, secs % 60);
+	return buf;
+}
+
+static void
+simrun(const char *policy, struct simjob *sj, size_t cores)
+{
+	struct build **parked = NULL;
+	size_t nparked = 0, parkedcap = 0, nrun = 0, njobs = 0, nleft = 0;
+	uint64_t now = 0, busy = 0, corebusy = 0;
+	char buf[32];
+
+	for (;;) {
+		while (nwork > 0 && nrun < numslots) {
+			struct executor *ex = NULL;
+			if ((numlocal == maxjobs || masterdirbusy(work[0])) &&
+			    (!(work[0]->flags & FLAG_DEPS) || !(ex = executorfree()))) {
+				if (numlocal == maxjobs)
+					break;
+				parked = grow(parked, nparked, &parkedcap, sizeof *parked);
+				parked[nparked++] = dequeue();
+				continue;
+			}
+			struct simjob *s = &sj[nrun++];
+			s->build = dequeue();
+			s->exec = ex;
+			s->masterdir = NULL;
+			if (ex) {
+				s->ntokens = ex->cores / ex->slots > 0 ? ex->cores / ex->slots : 1;
+				ex->used++;
+			} else {
+				s->ntokens = jobtokens(s->build);
+				if (s->build->flags & FLAG_DEPS)
+					s->masterdir = masterdirlease(s->build);
+				numtokens += s->ntokens, numlocal++;
+			}
+			s->start = now;
+			s->end = simcost(s->build, s->ntokens);
+			/* more jobs than cores, they share them */
+			if (!ex && numtokens > maxtokens)
+				s->end = s->end * numtokens / maxtokens;
+			s->end += now;
+		}
+		while (nparked > 0)
+			queue(parked[--nparked]);
+		if (nrun == 0)
+			break;
+
+		/* advance to the next job to finish */
+		size_t i = 0;
+		for (size_t k = 1; k < nrun; k++) {
+			if (sj[k].end < sj[i].end)
+				i = k;
+		}
+		struct simjob s = sj[i];
+		sj[i] = sj[--nrun];
+		now = s.end;
+		busy += s.end - s.start;
+		/* the work done, not the cores held while waiting on the serial part */
+		corebusy += simcost(s.build, 1);
+		njobs++;
+		if (s.exec)
+			s.exec->used--;
+		else
+			numtokens -= s.ntokens, numlocal--;
+		if (s.masterdir)
+			masterdirrelease(s.masterdir);
+
+		struct build *build = s.build;
+		if (!(build->flags & FLAG_DEPS)) {
+			build->flags |= FLAG_DEPS;
+			queue(build);
+			continue;
+		}
+		build->flags &= ~FLAG_DIRTY;
+		pkgnamedone(build->pkgname, build->builder, false);
+		for (size_t k = 0; k < build->nsubpkgs; k++)
+			pkgnamedone(build->subpkgs[k], build->builder, false);
+	}
+	free(parked);
+
+	for (struct build *b = builds; b; b = b->allnext) {
+		if ((b->flags & (FLAG_WORK|FLAG_DIRTY|FLAG_SKIP)) == (FLAG_WORK|FLAG_DIRTY))
+			nleft++;
+	}
+	printf("%-14s %10s %6.1f%% %6.1f%% %8zu", policy, simduration(buf, sizeof buf, now),
+	    now ? 100.0 * busy / now / numslots : 0, now ? 100.0 * corebusy / now / cores : 0, njobs);
+	if (nleft > 0)
+		printf(" (%zu never ready)", nleft);
+	printf("\n");
+}
+
+static void
+simulate(void)
+{
+	struct build **saved;
+	struct simjob *sj;
+	size_t nbuilds = 0, nsaved = nwork, cores = maxtokens, njobs = 0;
+	uint64_t total = 0, critical = 0;
+	struct builder *builder, *tmp;
+	char buf1[32], buf2[32];
+
+	for (struct build *b = builds; b; b = b->allnext) {
+		nbuilds++;
+		if ((b->flags & (FLAG_WORK|FLAG_DIRTY|FLAG_SKIP)) != (FLAG_WORK|FLAG_DIRTY) || b->flags & FLAG_FETCH)
+			continue;
+		njobs++;
+		total += simcost(b, 1);
+		if (!(b->flags & FLAG_DEPS)) {
+			/* the build after dependency generation */
+			b->flags |= FLAG_DEPS;
+			njobs++;
+			total += simcost(b, 1);
+			b->flags &= ~FLAG_DEPS;
+		}
+		if (b->prio > critical)
+			critical = b->prio;
+	}
+	for (struct executor *ex = executors; ex; ex = ex->next)
+		cores += ex->cores;
+
+	/* every run consumes the graph, restore it from the initial state */
+	struct {
+		int flags;
+		size_t nblock;
+		uint64_t prio;
+	} *state = xzmalloc((nbuilds + 1) * sizeof *state);
+	size_t i = 0;
+	for (struct build *b = builds; b; b = b->allnext, i++) {
+		state[i].flags = b->flags;
+		state[i].nblock = b->nblock;
+		state[i].prio = b->prio;
+	}
+	saved = xzmalloc((nwork + 1) * sizeof *saved);
+	memcpy(saved, work, nwork * sizeof *saved);
+	sj = xzmalloc(numslots * sizeof *sj);
+
+	printf("%zu builds, %zu jobs, %zu slots, %zu cores\n", numtotal, njobs, numslots, cores);
+	printf("critical path %s, work per core %s\n", simduration(buf1, sizeof buf1, critical),
+	    simduration(buf2, sizeof buf2, total / cores));
+	printf("%-14s %10s %7s %7s %8s\n", "priority", "makespan", "slots", "cores", "jobs");
+	for (int pass = 0; pass < 2; pass++) {
+		i = 0;
+		for (struct build *b = builds; b; b = b->allnext, i++) {
+			b->flags = state[i].flags;
+			b->nblock = state[i].nblock;
+			/* without priorities the heap only keeps them apart by luck */
+			b->prio = pass == 0 ? state[i].prio : 0;
+		}
+		HASH_ITER(hh, builders, builder, tmp) {
+			for (size_t k = 0; k < builder->nmasterdirs; k++)
+				builder->masterdirs[k]->last = NULL;
+		}
+		memcpy(work, saved, nsaved * sizeof *work);
+		nwork = nsaved;
+		simrun(pass == 0 ? "critical-path" : "none", sj, cores);
+	}
+	free(sj);
+	free(saved);
+	free(state);
+}
+
+/*
+ * -w: stay resident and replan packages as their templates change.  srcpkgs
+ * and every source package directory in it are watched with inotify, the
+ * changed packages are collected for WATCHDELAY milliseconds so a checkout
+ * is replanned in one go.  A changed build gets its dependencies generated
+ * again and the pending dependents wait for it, running jobs are left alone
+ * and their builds replanned once they finished.
+ */
+enum { WATCHDELAY = 1000 };
+
+static bool watching;
+/* no targets, new packages are built too */
+static bool watchall;
+static int watchfd = -1, watchroot = -1;
+/* source package of each watch descriptor */
+static struct pkgname **watchwds;
+static size_t watchwdscap;
+static struct pkgname **watchq;
+static size_t nwatchq, watchqcap;
+static struct timespec watchdue;
+
+static void
+watchdir(const char *name)
+{
+	char path[PATH_MAX];
+	int wd;
+
+	xsnprintf(path, sizeof path, "%s/srcpkgs/%s", distdir, name);
+	if ((wd = inotify_add_watch(watchfd, path, IN_CLOSE_WRITE|IN_MOVED_TO|IN_ATTRIB|IN_ONLYDIR|IN_DONT_FOLLOW)) == -1) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return;
+		fprintf(stderr, "inotify_add_watch: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if ((size_t)wd >= watchwdscap) {
+		size_t cap = watchwdscap ? watchwdscap : 1024;
+		while (cap <= (size_t)wd)
+			cap *= 2;
+		if (!(watchwds = reallocarray(watchwds, cap, sizeof *watchwds))) {
+			perror("reallocarray");
+			exit(1);
+		}
+		memset(watchwds + watchwdscap, 0, (cap - watchwdscap) * sizeof *watchwds);
+		watchwdscap = cap;
+	}
+	watchwds[wd] = mkpkgname(name);
+}
+
+static void
+watchinit(void)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+
+	if ((watchfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1) {
+		perror("inotify_init1");
+		exit(1);
+	}
+	xsnprintf(path, sizeof path, "%s/srcpkgs", distdir);
+	if ((watchroot = inotify_add_watch(watchfd, path, IN_CREATE|IN_MOVED_TO|IN_ONLYDIR)) == -1) {
+		fprintf(stderr, "inotify_add_watch: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (!(dir = opendir(path))) {
+		fprintf(stderr, "opendir: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.' || (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN))
+			continue;
+		watchdir(ent->d_name);
+	}
+	closedir(dir);
+	evadd(watchfd, EV_WATCH, 0);
+	fprintf(stderr, "watching %s for changes\n", path);
+}
+
+static void
+watchmark(struct pkgname *pkgname)
+{
+	for (size_t i = 0; i < nwatchq; i++) {
+		if (watchq[i] == pkgname)
+			goto out;
+	}
+	watchq = grow(watchq, nwatchq, &watchqcap, sizeof *watchq);
+	watchq[nwatchq++] = pkgname;
+out:
+	/* wait for the changes to settle */
+	clock_gettime(CLOCK_MONOTONIC, &watchdue);
+	watchdue.tv_nsec += WATCHDELAY % 1000 * 1000000;
+	watchdue.tv_sec += WATCHDELAY / 1000 + watchdue.tv_nsec / 1000000000;
+	watchdue.tv_nsec %= 1000000000;
+}
+
+static void
+watchread(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+
+	while ((n = read(watchfd, buf, sizeof buf)) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof *ev + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "warn: inotify queue overflow, replanning all packages\n");
+				for (size_t i = 0; i < watchwdscap; i++) {
+					if (watchwds[i])
+						watchmark(watchwds[i]);
+				}
+			} else if (ev->wd == watchroot) {
+				/* a new package */
+				if (ev->mask & IN_ISDIR && ev->len > 0) {
+					watchdir(ev->name);
+					watchmark(mkpkgname(ev->name));
+				}
+			} else if ((size_t)ev->wd < watchwdscap && watchwds[ev->wd]) {
+				if (ev->mask & IN_IGNORED)
+					watchwds[ev->wd] = NULL;
+				else if (ev->len > 0 && strcmp(ev->name, "template") == 0)
+					watchmark(watchwds[ev->wd]);
+			}
+		}
+	}
+	if (n == -1 && errno != EAGAIN) {
+		perror("read");
+		exit(1);
+	}
+}
+
+/* milliseconds until the collected changes are replanned, -1 if none */
+static int
+watchtimeout(void)
+{
+	struct timespec now;
+	long ms;
+
+	if (nwatchq == 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (watchdue.tv_sec - now.tv_sec) * 1000 + (watchdue.tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+/* take a build out of the work heap */
+static bool
+unqueue(struct build *build)
+{
+	for (size_t i = 0; i < nwork; i++) {
+		if (work[i] != build)
+			continue;
+		work[i] = work[--nwork];
+		if (i < nwork) {
+			worksiftdown(i);
+			worksiftup(i);
+		}
+		return true;
+	}
+	return false;
+}
+
+static bool
+buildrunning(struct build *build)
+{
+	for (size_t i = 0; i < numslots; i++) {
+		struct job *j = &jobs[i];
+		if (j->pid <= 0)
+			continue;
+		if (j->build == build)
+			return true;
+		for (size_t k = 0; k < j->nbatch; k++) {
+			if (j->batch[k] == build)
+				return true;
+		}
+	}
+	return false;
+}
+
+static void
+pkgnameunuse(struct pkgname *pkgname, struct build *build)
+{
+	for (size_t i = 0; i < pkgname->nuse;) {
+		if (pkgname->use[i].build == build)
+			pkgname->use[i] = pkgname->use[--pkgname->nuse];
+		else
+			i++;
+	}
+}
+
+/* the pending dependents of the packages of a build */
+static void
+pendingusers(struct build *build, struct build ***users, size_t *nusers, size_t *cap)
+{
+	for (size_t i = 0; i <= build->nsubpkgs; i++) {
+		struct pkgname *pkgname = i == 0 ? build->pkgname : build->subpkgs[i-1];
+		for (size_t k = 0; k < pkgname->nuse; k++) {
+			struct build *user = pkgname->use[k].build;
+			if (pkgname->use[k].builder != build->builder || user == build || !pending(user) ||
+			    user->flags & FLAG_FETCH)
+				continue;
+			*users = grow(*users, *nusers, cap, sizeof **users);
+			(*users)[(*nusers)++] = user;
+		}
+	}
+}
+
+/* subpackages are known once the dependencies are read, until then the
+ * links in srcpkgs tell, which still name a removed subpackage's source */
+static bool
+provides(struct build *build, struct pkgname *pkgname)
+{
+	if (build->pkgname == pkgname)
+		return true;
+	if (!(build->flags & FLAG_DEPS))
+		return pkgname->srcpkg == build->pkgname;
+	for (size_t i = 0; i < build->nsubpkgs; i++) {
+		if (build->subpkgs[i] == pkgname)
+			return true;
+	}
+	return false;
+}
+
+/* count the dependencies a pending build waits for again, see builddep */
+static void
+recount(struct build *build)
+{
+	struct builder *host = build->builder->host ? build->builder->host : build->builder;
+	size_t n = build->ndefer;
+
+	unqueue(build);
+	for (size_t i = 0; i < build->nhostdeps + build->ntargetdeps; i++) {
+		bool hostdep = i < build->nhostdeps;
+		struct pkgname *dep = hostdep ? build->hostdeps[i] : build->targetdeps[i - build->nhostdeps];
+		struct builder *builder = hostdep ? host : build->builder;
+		struct pkgname *srcpkg = dep->srcpkg ? dep->srcpkg : dep;
+		for (size_t k = 0; k < srcpkg->nbuilds; k++) {
+			struct build *b = srcpkg->builds[k];
+			if (b->builder != builder || b == build || !provides(b, dep))
+				continue;
+			if ((b->flags & (FLAG_DIRTY|FLAG_SKIP)) == (FLAG_DIRTY|FLAG_SKIP)) {
+				buildpruned(build, dep);
+				return;
+			}
+			if (pending(b))
+				n++;
+		}
+	}
+	if ((build->nblock = n) == 0)
+		queue(build);
+}
+
+/*
+ * Replanned builds whose new subpackages are not known yet.  The pending
+ * users of the old packages are blocked meanwhile, they and the users of
+ * the new packages have their blocking dependencies counted again once
+ * they are, see replanusers.
+ */
+static struct replanned {
+	struct build *build;
+	struct build **users;
+	size_t nusers, userscap;
+} *replans;
+static size_t nreplans, replanscap;
+
+static void
+replanusers(struct build *build)
+{
+	struct replanned r;
+	size_t i;
+
+	for (i = 0; i < nreplans && replans[i].build != build; i++)
+		;
+	if (i == nreplans || (pending(build) && !(build->flags & FLAG_DEPS)))
+		return;
+	/* pruning the users can get here again */
+	r = replans[i];
+	replans[i] = replans[--nreplans];
+	pendingusers(build, &r.users, &r.nusers, &r.userscap);
+	for (i = 0; i < r.nusers; i++) {
+		/* already building against the old package */
+		if (pending(r.users[i]) && !buildrunning(r.users[i]))
+			recount(r.users[i]);
+	}
+	free(r.users);
+}
+
+/* forget what is known about a build and walk it again */
+static void
+replan(struct build *build)
+{
+	struct replanned *r = NULL;
+	int flags = build->flags;
+	size_t i;
+
+	if ((flags & (FLAG_WORK|FLAG_DIRTY|FLAG_SKIP)) == (FLAG_WORK|FLAG_DIRTY)) {
+		uint64_t cost = buildcost(build);
+		unqueue(build);
+		numtotal--;
+		remaining -= cost < remaining ? cost : remaining;
+	}
+	for (size_t i = 0; i < nreplans; i++) {
+		if (replans[i].build == build)
+			r = &replans[i];
+	}
+	if (!r) {
+		replans = grow(replans, nreplans, &replanscap, sizeof *replans);
+		r = &replans[nreplans++];
+		*r = (struct replanned){ .build = build };
+	}
+	i = r->nusers;
+	pendingusers(build, &r->users, &r->nusers, &r->userscap);
+	/* they must not start against the old packages, recount unblocks them */
+	for (; i < r->nusers; i++) {
+		if (buildrunning(r->users[i]))
+			continue;
+		unqueue(r->users[i]);
+		r->users[i]->nblock++;
+	}
+
+	if (explain)
+		fprintf(stderr, "explain %s@%s: template changed, replanning\n", build->pkgname->name, build->builder->arch);
+	for (size_t i = 0; i < build->nhostdeps; i++)
+		pkgnameunuse(build->hostdeps[i], build);
+	for (size_t i = 0; i < build->ntargetdeps; i++)
+		pkgnameunuse(build->targetdeps[i], build);
+	build->nhostdeps = build->ntargetdeps = build->nsubpkgs = 0;
+	build->dbent = NULL;
+	build->flags = 0;
+	build->nblock = build->ndefer = 0;
+	/* mtimes have a granularity of seconds, a dependency file written in
+	 * the same second as the template may be outdated already */
+	build->depmtime = build->deperrmtime = MTIME_MISSING;
+	build->logmtime = build->logerrmtime = MTIME_UNKNOWN;
+	build->cache = CACHE_UNKNOWN;
+
+	flags = buildadd(build->pkgname, build->builder);
+	/* skipped, the dependents are dropped with it */
+	if ((flags & (FLAG_DIRTY|FLAG_SKIP)) == (FLAG_DIRTY|FLAG_SKIP)) {
+		pkgnamedone(build->pkgname, build->builder, true);
+		for (size_t i = 0; i < build->nsubpkgs; i++)
+			pkgnamedone(build->subpkgs[i], build->builder, true);
+	} else if (!(flags & FLAG_DIRTY)) {
+		build->pkgname->dirty = false;
+		for (size_t i = 0; i < build->nsubpkgs; i++)
+			build->subpkgs[i]->dirty = false;
+	}
+	replanusers(build);
+}
+
+/* whether the package could be replanned, builds with running jobs wait */
+static bool
+watchpkg(struct pkgname *pkgname)
+{
+	char path[PATH_MAX];
+	struct builder *builder, *tmp;
+	struct stat st;
+
+	xsnprintf(path, sizeof path, "%s/template", pkgname->name);
+	if (fstatat(srcpkgsfd, path, &st, 0) == -1) {
+		if (errno != ENOENT)
+			fprintf(stderr, "stat: %s/srcpkgs/%s: %s\n", distdir, path, strerror(errno));
+		return true;
+	}
+	for (size_t i = 0; i < pkgname->nbuilds; i++) {
+		if (buildrunning(pkgname->builds[i]))
+			return false;
+	}
+	fprintf(stderr, "template changed: %s\n", pkgname->name);
+	pkgname->mtime = MTIME_UNKNOWN;
+	HASH_ITER(hh, builders, builder, tmp) {
+		struct build *build = NULL;
+		for (size_t i = 0; i < pkgname->nbuilds; i++) {
+			if (pkgname->builds[i]->builder == builder)
+				build = pkgname->builds[i];
+		}
+		if (build)
+			replan(build);
+		else if (watchall)
+			buildadd(pkgname, builder);
+	}
+	return true;
+}
+
+static void
+watchreplan(void)
+{
+	size_t n = 0;
+
+	if (watchtimeout() != 0)
+		return;
+	for (size_t i = 0; i < nwatchq; i++) {
+		if (!watchpkg(watchq[i]))
+			watchq[n++] = watchq[i];
+	}
+	nwatchq = n;
+	/* try again after the running jobs */
+	if (nwatchq > 0)
+		watchmark(watchq[0]);
+	eventstatus();
+}
+
+/* an adopted job is not our child, its shell recorded the exit status */
+static void
+adoptreap(size_t i)
+{
+	char name[PATH_MAX];
+	struct job *j = &jobs[i];
+	struct build *build = j->build;
+	struct rusage rusage = {0};
+	int status;
+
+	jobfile(jobkind(j), build->pkgname->name, build->version, build->revision, "status", name, sizeof name);
+	status = journalstatus(build->flags & FLAG_DEPS ? build->builder->logfd : build->builder->depfd, name);
+	if (status == -1)
+		status = SIGKILL;
+	jobreap(i, status, &rusage);
+}
+
+/*
+ * Take over the jobs still running from a killed run, see journalload.
+ * Jobs whose build is not ready in the new plan are terminated.
+ */
+static void
+journaladopt(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (size_t i = 0; i < norphans; i++) {
+		struct orphan *o = &orphans[i];
+		struct builder *builder = builderbyname(o->builder);
+		struct pkgname *pkgname = mkpkgname(o->pkgname);
+		struct build *build = NULL;
+		bool deps = strcmp(o->kind, "deps") == 0;
+
+		for (size_t k = 0; builder && k < pkgname->nbuilds; k++) {
+			if (pkgname->builds[k]->builder == builder)
+				build = pkgname->builds[k];
+		}
+		/* piped output died with us, the job fails on its next write */
+		if (o->piped || !usepidfd || numjobs == numslots || !build ||
+		    (build->flags & (FLAG_WORK|FLAG_DIRTY|FLAG_SKIP)) != (FLAG_WORK|FLAG_DIRTY) ||
+		    !(build->flags & FLAG_DEPS) != deps || !unqueue(build)) {
+			fprintf(stderr, "journal: %s@%s: terminating stale job %d\n", o->pkgname, o->builder, (int)o->pid);
+			jobsignal(o->pid, SIGTERM);
+			fprintf(journalfp, "end %d\n", (int)o->pid);
+			fflush(journalfp);
+			continue;
+		}
+
+		size_t slot = freejob;
+		struct job *j = &jobs[slot];
+		freejob = j->next;
+		j->build = build;
+		j->pid = o->pid;
+		j->adopted = true;
+		j->failed = false;
+		j->status = 0;
+		j->start = now;
+		j->deadline = now;
+		j->deadline.tv_sec += maxtime;
+		j->timedout = 0;
+		j->cost = buildcost(build);
+		j->ntokens = o->ntokens > 0 ? o->ntokens : 1;
+		j->exec = NULL;
+		for (struct executor *ex = executors; o->host && ex; ex = ex->next) {
+			if (strcmp(ex->host, o->host) == 0)
+				j->exec = ex;
+		}
+		j->masterdir = NULL;
+		for (size_t k = 0; o->masterdir && k < builder->nmasterdirs; k++) {
+			struct masterdir *md = builder->masterdirs[k];
+			if (strcmp(md->path, o->masterdir) == 0 && !md->build) {
+				md->build = build;
+				j->masterdir = md;
+			}
+		}
+		j->cgroupfd = -1;
+		if (o->cgroup && cgroupfd != -1 && (j->cgroupfd = openat(cgroupfd, o->cgroup, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) != -1)
+			strlcpy(j->cgroup, o->cgroup, sizeof j->cgroup);
+		if (j->exec)
+			j->exec->used++;
+		else
+			numtokens += j->ntokens, numlocal++;
+		numjobs++;
+		fprintf(stderr, "journal: %s@%s: adopted running %s job %d\n", o->pkgname, o->builder, o->kind, (int)o->pid);
+		eventjob("start", j, jobkind(j));
+		/* it may have exited in the meantime */
+		if ((j->pidfd = xpidfd_open(j->pid)) == -1) {
+			if (errno != ESRCH) {
+				perror("pidfd_open");
+				exit(1);
+			}
+			adoptreap(slot);
+			continue;
+		}
+		evadd(j->pidfd, EV_PIDFD, slot);
+	}
+	norphans = 0;
+}
+
+static void
+build(void)
+{
+	struct epoll_event events[32];
+	struct build **parked = NULL;
+	size_t nparked = 0, parkedcap = 0;
+
+	jobs = calloc(numslots, sizeof *jobs);
+	if (!jobs) {
+		perror("calloc");
+		exit(1);
+	}
+	for (size_t i = 0; i < numslots; ++i) {
+		jobs[i].next = i + 1;
+		jobs[i].pidfd = -1;
+		jobs[i].outfd = -1;
+		jobs[i].cgroupfd = -1;
+		jobs[i].logfd = -1;
+		jobs[i].logtmp = -1;
+	}
+	evinit();
+	if (watching)
+		watchinit();
+	journaladopt();
+
+	for (;;) {
+		bool held = false;
+		while (!stopping && nwork > 0 && numjobs < numslots) {
+			struct executor *ex = NULL;
+			bool local = dryrun;
+			if (!dryrun && numlocal < maxjobs && !masterdirbusy(work[0])) {
+				if (admit(work[0]))
+					local = true;
+				else
+					held = true;
+			}
+			/* fetches go to the local repository, dependency
+			 * generation keeps stdout and stderr apart, which
+			 * the remote pty would merge */
+			if (!local && (work[0]->flags & FLAG_FETCH || !(work[0]->flags & FLAG_DEPS) || !(ex = executorfree()))) {
+				if (held || (numlocal == maxjobs && !executorfree()))
+					break;
+				/* set aside builds for busy masterdirs or local only
+				 * jobs to keep the others busy */
+				if (nparked == parkedcap) {
+					parkedcap = parkedcap ? parkedcap * 2 : 64;
+					if (!(parked = reallocarray(parked, parkedcap, sizeof *parked))) {
+						perror("reallocarray");
+						exit(1);
+					}
+				}
+				parked[nparked++] = dequeue();
+				continue;
+			}
+			struct build *build = dequeue();
+			uint64_t cost = buildcost(build);
+			if (dryrun) {
+				numfinished++;
+				remaining -= cost < remaining ? cost : remaining;
+				fprintf(stderr, "[%zu/%zu] build %s\n", numfinished, numtotal, build->pkgname->name);
+				pkgnamedone(build->pkgname, build->builder, false);
+				for (size_t i = 0; i < build->nsubpkgs; i++) {
+					pkgnamedone(build->subpkgs[i], build->builder, false);
+				}
+				continue;
+			}
+
+			jobs[freejob].exec = ex;
+			if (jobstart(&jobs[freejob], build) == -1) {
+				fprintf(stderr, "job failed to start: %s\n", build->pkgname->name);
+				numfinished++;
+				remaining -= cost < remaining ? cost : remaining;
+				failure();
+				buildfailed(build);
+				continue;
+			}
+			size_t i = freejob;
+			freejob = jobs[i].next;
+			jobwatch(i);
+			numjobs++;
+		}
+		while (nparked > 0)
+			queue(parked[--nparked]);
+
+		if (numjobs == 0 && !stopping && nwork == 0)
+			deadlock();
+		if (numjobs == 0 && (!watching || stopping))
+			break;
+
+		/* re-evaluate held back jobs from time to time */
+		int timeout = jobtimeouts(), t;
+		if (held && (timeout == -1 || timeout > 5000))
+			timeout = 5000;
+		if ((t = eventtimeout()) != -1 && (timeout == -1 || t < timeout))
+			timeout = t;
+		if ((t = watchtimeout()) != -1 && (timeout == -1 || t < timeout))
+			timeout = t;
+		if ((t = checkpoint()) != -1 && (timeout == -1 || t < timeout))
+			timeout = t;
+		int n = epoll_wait(epfd, events, sizeof events / sizeof *events, timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (int k = 0; k < n; k++) {
+			uint32_t type = events[k].data.u64 >> 32, idx = events[k].data.u64;
+			switch (type) {
+			case EV_SIGNAL:
+				sigevent();
+				break;
+			case EV_PIDFD: {
+				int status;
+				struct rusage rusage;
+				if (jobs[idx].adopted) {
+					adoptreap(idx);
+					break;
+				}
+				if (wait4(jobs[idx].pid, &status, WNOHANG, &rusage) <= 0)
+					break;
+				jobreap(idx, status, &rusage);
+				break;
+			}
+			case EV_DUMP:
+				if (jobs[idx].outfd != -1)
+					batchread(&jobs[idx]);
+				break;
+			case EV_METRICS:
+				metricsaccept();
+				break;
+			case EV_SCRAPE:
+				if (!scrapeflush(idx))
+					metricsscrape(idx);
+				break;
+			case EV_WATCH:
+				watchread();
+				break;
+			case EV_EVENTS:
+				if (eventsfd != -1)
+					eventflush();
+				break;
+			case EV_LOG:
+				if (jobs[idx].logfd != -1)
+					logread(&jobs[idx]);
+				break;
+			}
+		}
+		if (watching && !stopping)
+			watchreplan();
+	}
+	if (cgroupfd != -1)
+		cgroupfini();
+	eventstatus();
+}
+
+struct pkgstat {
+	struct pkgname *pkgname;
+	int err;
+	mode_t mode;
+	time_t mtime;
+	char *target;
+};
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Read srcpkgs with large getdents64 batches and keep the entry types, so
+ * prefetch only needs a single readlinkat or template stat per entry.
+ */
+static size_t
+scan(struct pkgstat **psp)
+{
+	static char buf[1 << 20];
+	struct pkgstat *ps = NULL;
+	size_t n = 0, cap = 0;
+	ssize_t len;
+	int dirfd;
+
+	/* getdents consumes the offset, keep srcpkgsfd for the *at calls */
+	if ((dirfd = openat(srcpkgsfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		fprintf(stderr, "open: %s/srcpkgs: %s\n", distdir, strerror(errno));
+		exit(1);
+	}
+
+	profcount(PROF_OPEN, 1);
+	while ((len = syscall(SYS_getdents64, dirfd, buf, sizeof buf)) > 0) {
+		profcount(PROF_GETDENTS, 1);
+		profcount(PROF_BYTES, len);
+		for (ssize_t off = 0; off < len;) {
+			struct linux_dirent64 *ent = (struct linux_dirent64 *)(buf + off);
+			off += ent->d_reclen;
+			if (*ent->d_name == '.')
+				continue;
+			if (n == cap) {
+				cap = cap ? cap * 2 : 4096;
+				if (!(ps = reallocarray(ps, cap, sizeof *ps))) {
+					perror("reallocarray");
+					exit(1);
+				}
+			}
+			ps[n] = (struct pkgstat){ .pkgname = mkpkgname(ent->d_name) };
+			switch (ent->d_type) {
+			case DT_DIR: ps[n].mode = S_IFDIR; break;
+			case DT_LNK: ps[n].mode = S_IFLNK; break;
+			case DT_UNKNOWN: break;
+			default: ps[n].mode = S_IFREG; break;
+			}
+			n++;
+		}
+	}
+	if (len == -1) {
+		fprintf(stderr, "getdents64: %s/srcpkgs: %s\n", distdir, strerror(errno));
+		exit(1);
+	}
+	close(dirfd);
+	*psp = ps;
+	return n;
+}
+
+struct parallel {
+	size_t n;
+	atomic_size_t next;
+	void (*fn)(size_t, void *);
+	void *arg;
+};
+
+static void *
+parallelworker(void *arg)
+{
+	struct parallel *p = arg;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&p->next, 1)) < p->n)
+		p->fn(i, p->arg);
+	return NULL;
+}
+
+/* call fn for every index below n from a pool of threads */
+static void
+parallel(size_t n, void (*fn)(size_t, void *), void *arg)
+{
+	struct parallel p = { .n = n, .fn = fn, .arg = arg };
+	pthread_t threads[32];
+	size_t nthreads = maxtokens < 32 ? maxtokens : 32;
+
+	atomic_init(&p.next, 0);
+	if (nthreads > n)
+		nthreads = n;
+	for (size_t i = 1; i < nthreads; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, parallelworker, &p))) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	parallelworker(&p);
+	for (size_t i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+
+static void
+prefetchpkgname(size_t i, void *arg)
+{
+	struct pkgstat *ps = (struct pkgstat *)arg + i;
+	char buf[PATH_MAX];
+	struct stat st;
+
+	/* filesystems without d_type */
+	if (ps->mode == 0) {
+		profcount(PROF_STAT, 1);
+		if (fstatat(srcpkgsfd, ps->pkgname->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			ps->err = errno;
+			return;
+		}
+		ps->mode = st.st_mode;
+	}
+	if (S_ISLNK(ps->mode)) {
+		ssize_t len;
+		profcount(PROF_READLINK, 1);
+		if ((len = readlinkat(srcpkgsfd, ps->pkgname->name, buf, sizeof buf)) == -1) {
+			ps->err = errno;
+			return;
+		}
+		if ((size_t)len >= sizeof buf) {
+			ps->err = ENOBUFS;
+			return;
+		}
+		buf[len] = '\0';
+		if (!(ps->target = strdup(buf))) {
+			perror("strdup");
+			exit(1);
+		}
+	} else if (S_ISDIR(ps->mode)) {
+		xsnprintf(buf, sizeof buf, "%s/template", ps->pkgname->name);
+		profcount(PROF_STAT, 1);
+		if (fstatat(srcpkgsfd, buf, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			ps->err = errno;
+			return;
+		}
+		ps->mtime = st.st_mtime;
+	}
+}
+
+static void
+prefetchbuild(size_t i, void *arg)
+{
+	struct build *build = ((struct build **)arg)[i];
+
+	depstat(build);
+	/* the version is only known up front from the database */
+	if (build->dbent) {
+		struct builder *builder = build->builder;
+		if (*dbstr(builder, build->dbent->version))
+			build->version = (char *)dbstr(builder, build->dbent->version);
+		if (*dbstr(builder, build->dbent->revision))
+			build->revision = (char *)dbstr(builder, build->dbent->revision);
+		logstat(build);
+		/* remote lookups are slow, do them here for up to date versions */
+		if (build->depmtime >= build->pkgname->mtime && build->logmtime == MTIME_MISSING &&
+		    build->logerrmtime == MTIME_MISSING)
+			cachecheck(build);
+	}
+}
+
+/*
+ * Stat all scanned packages and their dependency and log files from a pool
+ * of threads before the graph is walked, which fills in mtime, depmtime
+ * and logmtime.  Errors are left for pkgnamestat to report.
+ */
+static void
+prefetch(struct pkgstat *ps, size_t n)
+{
+	struct pkgname *pkgname;
+	struct builder *builder, *tmpbuilder;
+	struct build **bl;
+	size_t nb = 0, i;
 
-	loaddeps(build);
-	if ((build->flags & FLAG_DEPS)) {
-		logstat(build);
-		if (build->logmtime == MTIME_MISSING) {
-			if (build->logerrmtime == MTIME_MISSING) {
-				/* Build the package if log and error mtime are missing */
-				if (explain)
-					fprintf(stderr, "explain %s@%s: missing\n", build->pkgname->name, build->builder->arch);
-				build->flags |= FLAG_DIRTY;
-			} else if (build->logerrmtime < build->pkgname->mtime) {
-				/* Build the package if log mtime is missing and error mtime is older than the template */
-				if (explain)
-					fprintf(stderr, "explain %s@%s: reattempt, template changed since previous error\n", build->pkgname->name, build->builder->arch, build->pkgname->name);
-				build->flags |= FLAG_DIRTY;
-			} else {
-				build->flags |= FLAG_SKIP|FLAG_DIRTY;
-				if (explain)
-					fprintf(stderr, "explain %s@%s: skipping, template unchanged since previous error\n", build->pkgname->name, build->builder->arch, build->pkgname->name);
-				goto out;
-			}
-		}
+	parallel(n, prefetchpkgname, ps);
 
-		build->nblock = 0;
-		struct builder *hostbuilder = builder->host ? builder->host : builder;
-		for (size_t i = 0; i < build->nhostdeps; i++) {
-			struct pkgname *n1 = build->hostdeps[i];
-			int flags = _buildadd(n1, hostbuilder);
-			if (flags & FLAG_CYCLE) {
-				build->flags |= FLAG_SKIP|FLAG_DIRTY;
-				fprintf(stderr, " <- %s", pkgname->name);
-				goto err;
+	for (i = 0; i < n; i++) {
+		pkgname = ps[i].pkgname;
+		if (ps[i].err)
+			continue;
+		if (S_ISLNK(ps[i].mode)) {
+			size_t len = strlen(ps[i].target);
+			if (len > 0 && ps[i].target[len-1] == '/') {
+				fprintf(stderr, "warn: symlink `%s/srcpkgs/%s` contains trailing slash.\n", distdir, pkgname->name);
+				ps[i].target[len-1] = '\0';
 			}
-			if (flags & FLAG_DIRTY)
-				build->nblock++;
+			pkgname->srcpkg = mkpkgname(ps[i].target);
+		} else if (S_ISDIR(ps[i].mode)) {
+			pkgname->mtime = ps[i].mtime;
+		} else {
+			pkgname->mtime = MTIME_MISSING;
 		}
+		free(ps[i].target);
+	}
+	/* subpackages take the mtime of their source package */
+	for (i = 0; i < n; i++) {
+		pkgname = ps[i].pkgname;
+		if (!ps[i].err && S_ISLNK(ps[i].mode))
+			pkgname->mtime = pkgname->srcpkg->mtime;
+	}
 
-		for (size_t i = 0; i < build->ntargetdeps; i++) {
-			struct pkgname *n1 = build->targetdeps[i];
-			int flags = _buildadd(n1, builder);
-			if (flags & FLAG_CYCLE) {
-				build->flags |= FLAG_SKIP|FLAG_DIRTY;
-				fprintf(stderr, " <- %s", pkgname->name);
-				goto err;
-			}
-			if (flags & FLAG_DIRTY)
-				build->nblock++;
-		}
+	/* all source packages get a build for every builder */
+	HASH_ITER(hh, builders, builder, tmpbuilder)
+		buildername(builder);
+	for (i = 0; i < n; i++) {
+		if (ps[i].err || !S_ISDIR(ps[i].mode))
+			continue;
+		HASH_ITER(hh, builders, builder, tmpbuilder)
+			nb++;
+	}
+	if (!(bl = calloc(nb ? nb : 1, sizeof *bl))) {
+		perror("calloc");
+		exit(1);
+	}
+	nb = 0;
+	for (i = 0; i < n; i++) {
+		if (ps[i].err || !S_ISDIR(ps[i].mode))
+			continue;
+		HASH_ITER(hh, builders, builder, tmpbuilder)
+			bl[nb++] = mkbuild(ps[i].pkgname, builder);
 	}
+	free(ps);
+	parallel(nb, prefetchbuild, bl);
+	free(bl);
+}
 
-out:
-	build->flags &= ~FLAG_CYCLE;
-err:
-	if (build->flags & FLAG_DIRTY) {
-		/* Missing deps or missing package, mark all packages as dirty */
-		build->pkgname->dirty = true;
-		for (size_t i = 0; i < build->nsubpkgs; i++) {
-			struct pkgname *n1 = build->subpkgs[i];
-			n1->dirty = true;
-		}
+/*
+ * Incremental mode: the commit of the last complete run is kept in the
+ * gitrev file.  Packages git reports as changed since then are checked
+ * against the tree, everything else is taken from the dependency database.
+ */
+static bool gitmode;
+static char gitrev[64];
+static struct pkgname **changed;
+static size_t nchanged, changedcap;
 
-		if (!(build->flags & FLAG_SKIP)) {
-			if (build->nblock == 0)
-				queue(build);
-			numtotal++;
+/* run argv and call fn for every line it writes to stdout */
+static int
+gitlines(char *const argv[], void (*fn)(char *, size_t))
+{
+	extern char **environ;
+	posix_spawn_file_actions_t actions;
+	int fd[2], err, status;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	pid_t pid;
+	FILE *fp;
+
+	if (pipe2(fd, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		exit(1);
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fd[1], 1);
+	profcount(PROF_SPAWN, 1);
+	err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fd[1]);
+	if (err) {
+		fprintf(stderr, "posix_spawn: %s: %s\n", argv[0], strerror(err));
+		close(fd[0]);
+		return -1;
+	}
+	if (!(fp = fdopen(fd[0], "r"))) {
+		perror("fdopen");
+		exit(1);
+	}
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		if (len > 0 && line[len-1] == '\n')
+			line[--len] = '\0';
+		fn(line, len);
+	}
+	free(line);
+	fclose(fp);
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			exit(1);
 		}
 	}
-	return build->flags;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
 }
 
 static void
-buildadd(struct pkgname *pkgname, struct builder *builder)
+githead(char *line, size_t len)
 {
-	int rv;
-	if ((rv = _buildadd(pkgname, builder)) != 0) {
-		if (rv == ELOOP) {
-			fprintf(stderr, "\n");
-			return;
-		}
-	}
+	if (len < sizeof gitrev)
+		memcpy(gitrev, line, len + 1);
 }
 
+/* srcpkgs/<name>[/...] */
 static void
-build(void)
+gitchanged(char *line, size_t len)
 {
-	struct job *jobs;
-	size_t numfail = 0;
-	size_t next = 0, numjobs = 0;
+	struct pkgname *pkgname;
+	char *p;
 
-	jobs = calloc(maxjobs, sizeof *jobs);
-	if (!jobs) {
-		perror("calloc");
-		exit(1);
-	}
-	for (size_t i = 0; i < maxjobs; ++i) {
-		jobs[i].next = i + 1;
+	if (strncmp(line, "srcpkgs/", 8) != 0)
+		return;
+	line += 8;
+	len -= 8;
+	if ((p = memchr(line, '/', len)))
+		len = p - line;
+	if (len == 0)
+		return;
+	pkgname = mkpkgnamen(line, len);
+	if (pkgname->changed)
+		return;
+	pkgname->changed = true;
+	changed = grow(changed, nchanged, &changedcap, sizeof *changed);
+	changed[nchanged++] = pkgname;
+}
+
+static void
+gitusers(struct pkgname *pkgname, struct pkgname ***roots, size_t *nroots, size_t *cap)
+{
+	for (size_t i = 0; i < pkgname->nuse; i++) {
+		struct pkgname *user = pkgname->use[i].build->pkgname;
+		if (user->changed || user->gitroot)
+			continue;
+		user->gitroot = true;
+		*roots = grow(*roots, *nroots, cap, sizeof **roots);
+		(*roots)[(*nroots)++] = user;
 	}
+}
 
-	for (;;) {
-nextjob:
-		while (work && numjobs < maxjobs) {
-			struct build *build = work;
-			work = work->worknext;
-			if (dryrun) {
-				numfinished++;
-				fprintf(stderr, "[%zu/%zu] build %s\n", numfinished, numtotal, build->pkgname->name);
-				pkgnamedone(build->pkgname, false);
-				for (size_t i = 0; i < build->nsubpkgs; i++) {
-					pkgnamedone(build->subpkgs[i], false);
-				}
-				continue;
-			}
+/*
+ * Build the graph from the database and return the changed packages and
+ * everything depending on them as roots, or false if the whole tree has to
+ * be checked.
+ */
+static bool
+gitload(struct pkgname ***rootsp, size_t *nrootsp)
+{
+	struct builder *builder, *tmpbuilder;
+	char old[sizeof gitrev];
+	FILE *fp;
 
-			if (jobstart(&jobs[next], build) == -1) {
-				fprintf(stderr, "job failed to start: %s\n", build->pkgname->name);
-				numfail++;
-				continue;
-			}
-			const char *action = jobs[next].build->flags & FLAG_DEPS ? "build package" : "generated dependencies for";
-			/* fprintf(stderr, "[%zu/%zu] %s %s pid=%zu\n", numfinished, numtotal, action, jobs[next].build->pkgname->name, jobs[next].pid); */
-			next = jobs[next].next;
-			numjobs++;
+	if (!(fp = fopen("gitrev", "r"))) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "fopen: gitrev: %s\n", strerror(errno));
+			exit(1);
 		}
+		return false;
+	}
+	if (!fgets(old, sizeof old, fp))
+		old[0] = '\0';
+	fclose(fp);
+	old[strcspn(old, "\n")] = '\0';
+	if (old[0] == '\0')
+		return false;
 
-		if (numjobs == 0)
-			break;
+	HASH_ITER(hh, builders, builder, tmpbuilder) {
+		if (!builder->db)
+			return false;
+	}
 
-		for (;;) {
-			int status;
-			pid_t pid = waitpid(-1, &status, 0);
-			if (pid == -1) {
-				perror("waitpid");
-				exit(1);
-			}
+	char *diff[] = {"git", "-C", (char *)distdir, "diff", "--no-renames", "--name-only", old, "--", "srcpkgs", NULL};
+	char *others[] = {"git", "-C", (char *)distdir, "ls-files", "--others", "--exclude-standard", "--", "srcpkgs", NULL};
+	if (gitlines(diff, gitchanged) == -1 || gitlines(others, gitchanged) == -1) {
+		fprintf(stderr, "warn: git diff against %s failed, checking the whole tree\n", old);
+		return false;
+	}
 
-			for (size_t i = 0; i < maxjobs; i++) {
-				if (jobs[i].pid != pid)
+	HASH_ITER(hh, builders, builder, tmpbuilder) {
+		for (uint32_t i = 0; i < builder->db->nentries; i++) {
+			const struct dbentry *ent = &builder->dbentries[i];
+			struct pkgname *pkgname = mkpkgname(dbstr(builder, ent->name));
+			struct build *build;
+			if (pkgname->changed)
+				continue;
+			/* trust the database, the template did not change */
+			pkgname->mtime = ent->srcmtime;
+			build = mkbuild(pkgname, builder);
+			build->dbent = ent;
+			build->depmtime = ent->depmtime;
+			build->deperrmtime = MTIME_MISSING;
+			loaddeps(build);
+			for (size_t k = 0; k < build->nsubpkgs; k++) {
+				struct pkgname *sub = build->subpkgs[k];
+				if (sub->changed)
 					continue;
-				const char *action = jobs[i].build->flags & FLAG_DEPS ? "build package" : "generated dependencies for";
-				jobs[i].status = status;
-				jobdone(&jobs[i]);
-				numjobs--;
-				jobs[i].next = next;
-				jobs[i].pid = -1;
-				next = i;
-				if (jobs[i].failed)
-					numfail++;
-				fprintf(stderr, "[%zu/%zu] %s %s\n", numfinished, numtotal, action, jobs[i].build->pkgname->name);
-				goto nextjob;
+				sub->srcpkg = pkgname;
+				sub->mtime = pkgname->mtime;
 			}
 		}
 	}
+
+	struct pkgname **roots = NULL;
+	size_t nroots = 0, rootscap = 0;
+	for (size_t i = 0; i < nchanged; i++) {
+		struct pkgname *pkgname = changed[i];
+		if (explain)
+			fprintf(stderr, "explain: %s: changed since %.12s\n", pkgname->name, old);
+		roots = grow(roots, nroots, &rootscap, sizeof *roots);
+		roots[nroots++] = pkgname;
+		gitusers(pkgname, &roots, &nroots, &rootscap);
+		/* dependents name the subpackages of the previous template */
+		HASH_ITER(hh, builders, builder, tmpbuilder) {
+			const struct dbentry *ent = dbfind(builder, pkgname->name);
+			if (!ent || (uint64_t)ent->refs + ent->nhostdeps + ent->ntargetdeps + ent->nsubpkgs > builder->db->nrefs)
+				continue;
+			const uint32_t *ref = builder->dbrefs + ent->refs + ent->nhostdeps + ent->ntargetdeps;
+			for (uint32_t k = 0; k < ent->nsubpkgs; k++)
+				gitusers(mkpkgname(dbstr(builder, ref[k])), &roots, &nroots, &rootscap);
+		}
+	}
+	/* the users of users, directly or through their subpackages */
+	for (size_t i = 0; i < nroots; i++) {
+		struct pkgname *pkgname = roots[i];
+		if (pkgname->changed)
+			continue;
+		gitusers(pkgname, &roots, &nroots, &rootscap);
+		for (size_t k = 0; k < pkgname->nbuilds; k++) {
+			struct build *build = pkgname->builds[k];
+			for (size_t n = 0; n < build->nsubpkgs; n++)
+				gitusers(build->subpkgs[n], &roots, &nroots, &rootscap);
+		}
+	}
+	*rootsp = roots;
+	*nrootsp = nroots;
+	return true;
 }
 
 static void
-scan(void)
+gitsave(void)
 {
-	char buf[PATH_MAX];
-	DIR *dp;
-	struct dirent *ent;
-	int dirfd;
+	char buf[sizeof gitrev + 1];
+	int len = snprintf(buf, sizeof buf, "%s\n", gitrev);
 
-	xsnprintf(buf, sizeof buf, "%s/srcpkgs", distdir);
-
-	if ((dirfd = open(buf, O_DIRECTORY)) == -1) {
-		fprintf(stderr, "open: %s: %s", buf, strerror(errno));
+	if (!writefileat(AT_FDCWD, ".", "gitrev.tmp", buf, len))
+		exit(1);
+	if (rename("gitrev.tmp", "gitrev") == -1) {
+		fprintf(stderr, "rename: gitrev.tmp: %s\n", strerror(errno));
 		exit(1);
 	}
+}
 
-	dp = fdopendir(dirfd);
-	if (!dp) {
-		fprintf(stderr, "fdopendir: %s: %s", buf, strerror(errno));
-		exit(1);
+static void
+profreport(void)
+{
+	struct rusage ru;
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < nprofphases; i++) {
+		fprintf(stderr, "profile: phase %-12s %10.3fms\n", profphases[i].name, profphases[i].ns / 1e6);
+		total += profphases[i].ns;
+	}
+	fprintf(stderr, "profile: phase %-12s %10.3fms\n", "total", total / 1e6);
+	/* summed over the prefetch and resolve threads */
+	for (int i = 0; i < NPROFFUNC; i++) {
+		fprintf(stderr, "profile: func  %-12s %10.3fms %10" PRIu64 " calls\n", proffuncnames[i],
+		    proffuncns[i] / 1e6, (uint64_t)proffunccalls[i]);
 	}
+	for (int i = 0; i < NPROFCOUNT; i++)
+		fprintf(stderr, "profile: count %-12s %10" PRIu64 "\n", profcountnames[i], (uint64_t)profcounts[i]);
 
-	while ((ent = readdir(dp))) {
-		struct stat st;
-		if (*ent->d_name == '.')
-			continue;
-		struct pkgname *pkgname = mkpkgname(ent->d_name);
+	if (pkgnames.len > 0) {
+		size_t probes = 0, maxprobe = 0;
+		for (size_t i = 0; i < pkgnames.cap; i++) {
+			size_t d;
+			if (!pkgnames.slots[i].pkgname)
+				continue;
+			/* distance from the home slot, 0 if it sits there */
+			d = (i - pkgnames.slots[i].hash) & (pkgnames.cap - 1);
+			probes += d + 1;
+			if (d + 1 > maxprobe)
+				maxprobe = d + 1;
+		}
+		fprintf(stderr, "profile: pkgnames %zu items, %zu slots, %.2f probes average, %zu longest\n",
+		    pkgnames.len, pkgnames.cap, (double)probes / pkgnames.len, maxprobe);
 	}
-	closedir(dp);
-	close(dirfd);
+	fprintf(stderr, "profile: interned %zu strings, %zu slots\n", interned.len, interned.cap);
+	fprintf(stderr, "profile: arena %zukB\n", arena.size / 1024);
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(stderr, "profile: peak rss %ldkB\n", ru.ru_maxrss);
 }
 
 static int
@@ -1081,6 +6363,63 @@ mkpath(const char *path, mode_t mode)
 	}
 }
 
+/*
+ * Remote builds leave their packages in the hosts hostdir/binpkgs, where the
+ * builds depending on them have to find them.  Check that each host sees a
+ * directory created in the local one.
+ */
+static void
+remotecheck(void)
+{
+	extern char **environ;
+	char path[PATH_MAX], cmd[2*PATH_MAX];
+	posix_spawn_file_actions_t actions;
+	bool shared = true;
+
+	if (!executors)
+		return;
+	xsnprintf(path, sizeof path, "%s/hostdir/binpkgs", distdir);
+	if (mkpath(path, 0755) == -1) {
+		fprintf(stderr, "mkpath: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	xsnprintf(path, sizeof path, "%s/hostdir/binpkgs/.dbulk.XXXXXX", distdir);
+	if (!mkdtemp(path)) {
+		fprintf(stderr, "mkdtemp: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if ((errno = posix_spawn_file_actions_init(&actions)) ||
+	    (errno = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0))) {
+		perror("posix_spawn_file_actions");
+		exit(1);
+	}
+	for (struct executor *ex = executors; ex && shared; ex = ex->next) {
+		char *argv[8] = {"test", "-d", path, NULL};
+		int status;
+		pid_t pid;
+
+		remoteargv(ex, argv, cmd, sizeof cmd);
+		if ((errno = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ))) {
+			fprintf(stderr, "posix_spawn: ssh: %s\n", strerror(errno));
+			exit(1);
+		}
+		while (waitpid(pid, &status, 0) == -1) {
+			if (errno != EINTR) {
+				perror("waitpid");
+				exit(1);
+			}
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "remote: %s: does not share %s/hostdir/binpkgs\n", ex->host, distdir);
+			shared = false;
+		}
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	rmdir(path);
+	if (!shared)
+		exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -1090,14 +6429,66 @@ main(int argc, char *argv[])
 	const char *tool = NULL;
 	struct builder *builder, *tmpbuilder;
 
-	while ((c = getopt(argc, argv, "dD:j:nt:")) != -1)
+	const char **specs = xzmalloc(argc * sizeof *specs);
+	const char **remotes = xzmalloc(argc * sizeof *remotes);
+	size_t nspecs = 0, nremotes = 0;
+
+	cachedirs = xzmalloc(argc * sizeof *cachedirs);
+	cacheurls = xzmalloc(argc * sizeof *cacheurls);
+
+	while ((c = getopt(argc, argv, "b:B:c:C:dD:E:gG:j:J:k:l:L:M:npP:r:t:T:wz")) != -1)
 		switch (c) {
+		case 'c':
+			if (strncmp(optarg, "http://", 7) == 0 || strncmp(optarg, "https://", 8) == 0)
+				cacheurls[ncacheurls++] = optarg;
+			else
+				cachedirs[ncachedirs++] = optarg;
+			break;
+		case 'b':
+			specs[nspecs++] = optarg;
+			break;
+		case 'C':
+			cgcpumax = optarg;
+			break;
+		case 'G':
+			cgroupdir = optarg;
+			break;
+		case 'M':
+			cgmemmax = optarg;
+			break;
+		case 'T':
+			errno = 0;
+			ul = strtoul(optarg, NULL, 10);
+			if (errno != 0) {
+				fprintf(stderr, "strtoul: %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			maxtime = ul;
+			break;
+		case 'r':
+			remotes[nremotes++] = optarg;
+			break;
+		case 'B':
+			errno = 0;
+			ul = strtoul(optarg, NULL, 10);
+			if (errno != 0) {
+				fprintf(stderr, "strtoul: %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			batchsize = ul > 0 ? ul : 1;
+			break;
 		case 'd':
 			explain = true;
 			break;
 		case 'D':
 			distdir = optarg;
 			break;
+		case 'E':
+			eventpath = optarg;
+			break;
+		case 'g':
+			gitmode = true;
+			break;
 		case 'j':
 			errno = 0;
 			ul = strtoul(optarg, NULL, 10);
@@ -1105,24 +6496,146 @@ main(int argc, char *argv[])
 				fprintf(stderr, "strtoul: %s: %s\n", optarg, strerror(errno));
 				exit(1);
 			}
+			/* dependencies are generated locally, jobtokens shares -J among the slots */
+			if (ul == 0) {
+				fprintf(stderr, "-j: at least one local job slot is needed\n");
+				exit(1);
+			}
 			maxjobs = ul;
 			break;
+		case 'J':
+			errno = 0;
+			ul = strtoul(optarg, NULL, 10);
+			if (errno != 0) {
+				fprintf(stderr, "strtoul: %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			maxtokens = ul;
+			break;
+		case 'k':
+			errno = 0;
+			ul = strtoul(optarg, NULL, 10);
+			if (errno != 0) {
+				fprintf(stderr, "strtoul: %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			maxfail = ul > 0 ? ul : SIZE_MAX;
+			break;
+		case 'l':
+			errno = 0;
+			maxload = strtod(optarg, NULL);
+			if (errno != 0) {
+				fprintf(stderr, "strtod: %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			break;
+		case 'L': {
+			char *end;
+			errno = 0;
+			logmax = strtoull(optarg, &end, 10);
+			if (errno != 0) {
+				fprintf(stderr, "strtoull: %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			switch (*end) {
+			case 'G': logmax *= 1024; /* fallthrough */
+			case 'M': logmax *= 1024; /* fallthrough */
+			case 'K': logmax *= 1024; end++; break;
+			}
+			if (*end) {
+				fprintf(stderr, "invalid log size: %s\n", optarg);
+				exit(1);
+			}
+			logpipe = true;
+			break;
+		}
 		case 'n':
 			dryrun = true;
 			break;
+		case 'p':
+			profiling = true;
+			break;
+		case 'P':
+			metricsaddr = optarg;
+			break;
+		case 'w':
+			watching = true;
+			break;
+		case 'z':
+#ifndef HAVE_ZSTD
+			fprintf(stderr, "-z needs zstd, rebuild with HAVE_ZSTD=1\n");
+			exit(1);
+#endif
+			logzstd = logpipe = true;
+			break;
 		case 't':
 			tool = optarg;
+			if (strcmp(tool, "simulate") == 0) {
+				simulating = true;
+			} else {
+				fprintf(stderr, "unknown tool: %s\n", tool);
+				exit(1);
+			}
 			break;
 		default:
-			fprintf(stderr, "usage: %s [-den] [-D distdir] [-j jobs] [target...]\n", *argv);
+			fprintf(stderr, "usage: %s [-degnpwz] [-b arch[@host][:masterdir[,masterdir]...]]... [-B batch] [-c cache]... [-C cpu.max] [-D distdir] [-E events] [-G cgroup] [-j jobs] [-J cores] [-k maxfail] [-l load] [-L logsize] [-M memory.max] [-P [addr:]port] [-r host[:slots[:cores]]]... [-t simulate] [-T timeout] [target...]\n"
+			    "remote hosts need the distdir, including hostdir/binpkgs, shared at the same path\n", *argv);
 		}
 
 	argc -= optind;
 	argv += optind;
+	if (watching && (dryrun || tool)) {
+		fprintf(stderr, "-w cannot be used with -n or -t\n");
+		exit(1);
+	}
+	watchall = argc == 0;
+
+	/* simulate a build from scratch, nothing comes from the caches */
+	if (simulating)
+		ncachedirs = ncacheurls = 0;
+
+	if (maxtokens == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		maxtokens = n > 0 ? n : 1;
+	}
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&graphlock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	if (nspecs == 0) {
+		mkbuilder("aarch64", mkbuilder("x86_64", NULL));
+	} else {
+		/* native builders first, they are the hosts of cross builders */
+		for (size_t i = 0; i < nspecs; i++) {
+			const char *p = strpbrk(specs[i], "@:");
+			if (!p || *p == ':')
+				parsebuilder(specs[i]);
+		}
+		for (size_t i = 0; i < nspecs; i++) {
+			const char *p = strpbrk(specs[i], "@:");
+			if (p && *p == '@')
+				parsebuilder(specs[i]);
+		}
+	}
+	free(specs);
 
-	struct builder *host = mkbuilder("x86_64");
-	struct builder *cross = mkbuilder("aarch64");
-	cross->host = host;
+	numslots = maxjobs;
+	for (size_t i = 0; i < nremotes; i++)
+		parseexecutor(remotes[i]);
+	for (struct executor *ex = executors; ex; ex = ex->next)
+		numslots += ex->slots;
+	free(remotes);
+	if ((cgmemmax || cgcpumax) && !cgroupdir) {
+		fprintf(stderr, "-C and -M need a cgroup, see -G\n");
+		exit(1);
+	}
+	if (cgroupdir)
+		cgroupinit();
+	if (eventpath)
+		eventopen();
 
 	if (!distdir) {
 		static char defdistdir[PATH_MAX];
@@ -1135,44 +6648,110 @@ main(int argc, char *argv[])
 		distdir = defdistdir;
 	}
 
+	xsnprintf(path, sizeof path, "%s/srcpkgs", distdir);
+	if ((srcpkgsfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	cachedirfds = xzmalloc((ncachedirs + 1) * sizeof *cachedirfds);
+	for (size_t i = 0; i < ncachedirs; i++) {
+		if ((cachedirfds[i] = open(cachedirs[i], O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+			fprintf(stderr, "open: %s: %s\n", cachedirs[i], strerror(errno));
+			exit(1);
+		}
+	}
+	if (ncachedirs > 0) {
+		fetchdir = cachedirs[0];
+	} else {
+		static char deffetchdir[PATH_MAX];
+		xsnprintf(deffetchdir, sizeof deffetchdir, "%s/hostdir/binpkgs", distdir);
+		fetchdir = deffetchdir;
+	}
+	if (!dryrun && !tool)
+		remotecheck();
+
 	/* setup the state directories */
 	HASH_ITER(hh, builders, builder, tmpbuilder) {
-		if (builder->host)
-			xsnprintf(path, sizeof path, "logs/%s@%s", builder->arch, builder->host->arch);
-		else
-			xsnprintf(path, sizeof path, "logs/%s", builder->arch);
+		xsnprintf(path, sizeof path, "logs/%s", buildername(builder));
 		if (mkpath(path, 0755) == -1) {
 			fprintf(stderr, "mkpath: %s: %s\n", path, strerror(errno));
 			exit(1);
 		}
-		if (builder->host)
-			xsnprintf(path, sizeof path, "deps/%s@%s", builder->arch, builder->host->arch);
-		else
-			xsnprintf(path, sizeof path, "deps/%s", builder->arch);
+		builder->logdir = intern(path);
+		if ((builder->logfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+			fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+		xsnprintf(path, sizeof path, "deps/%s", buildername(builder));
 		if (mkpath(path, 0755) == -1) {
 			fprintf(stderr, "mkpath: %s: %s\n", path, strerror(errno));
 			exit(1);
 		}
+		builder->depdir = intern(path);
+		if ((builder->depfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+			fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
 	}
 
-	if (argc > 0) {
-		for (int i = 0; i < argc; i++) {
-			HASH_ITER(hh, builders, builder, tmpbuilder) {
-				buildadd(mkpkgname(argv[i]), builder);
-			}
+	uint64_t profstart = profnow();
+	histload("history");
+	profphase("history", &profstart);
+	if (!tool && !dryrun)
+		journalload("journal");
+	HASH_ITER(hh, builders, builder, tmpbuilder)
+		dbopen(builder);
+	profphase("dbopen", &profstart);
+
+	if (gitmode) {
+		char *head[] = {"git", "-C", (char *)distdir, "rev-parse", "HEAD", NULL};
+		if (gitlines(head, githead) == -1 || gitrev[0] == '\0') {
+			fprintf(stderr, "git: %s: cannot read HEAD\n", distdir);
+			exit(1);
 		}
+	}
+
+	struct pkgname **roots;
+	size_t nroots = 0;
+	if (argc > 0) {
+		roots = xzmalloc(argc * sizeof *roots);
+		for (int i = 0; i < argc; i++)
+			roots[nroots++] = mkpkgname(argv[i]);
+	} else if (gitmode && gitload(&roots, &nroots)) {
+		if (nroots == 0 && !tool)
+			fprintf(stderr, "nothing changed since last run\n");
+		profphase("gitload", &profstart);
 	} else {
-		struct pkgname *pkgname, *tmp;
-		scan();
+		struct pkgstat *ps;
+		size_t n = scan(&ps);
+		profphase("scan", &profstart);
+		prefetch(ps, n);
+		profphase("prefetch", &profstart);
 		/* build all packages */
-		HASH_ITER(hh, pkgnames, pkgname, tmp) {
-			HASH_ITER(hh, builders, builder, tmpbuilder) {
-				buildadd(pkgname, builder);
-			}
-		}
+		roots = xzmalloc((pkgnames.len + 1) * sizeof *roots);
+		for (size_t i = 0; i < pkgnames.len; i++)
+			roots[nroots++] = pkgnames.ids[i];
 	}
+	resolve(roots, nroots);
+	free(roots);
+	profphase("resolve", &profstart);
+
+	packedges();
+	workinit();
+	profphase("workinit", &profstart);
+	if (profiling)
+		profreport();
 
-	if (!tool)
+	if (simulating)
+		simulate();
+	else if (!tool)
 		build();
-	return 0;
+
+	HASH_ITER(hh, builders, builder, tmpbuilder)
+		dbwrite(builder);
+	/* failed, pruned and blocked builds have to be planned again next time */
+	if (gitmode && argc == 0 && !tool && !dryrun && !stopping && numfail == 0 && numfinished == numtotal)
+		gitsave();
+	return stopping ? 1 : 0;
 }